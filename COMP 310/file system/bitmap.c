@@ -1,53 +1,341 @@
 #include "sfs_api.h"
+#include "disk_emu.h"
 
-#include <strings.h>    // for `ffs`
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
-// the actual data. initialize all bits to high
-uint8_t free_bit_map[SIZE] = { [0 ... SIZE - 1] = UINT8_MAX };
+// the actual data, one bit per disk block, high when the block is free.
+// bit i lives in word i / 64, which on disk is the same layout as a byte
+// array with bit i in byte i / 8
+uint64_t* free_bit_map = NULL;
+
+// one bit per word of free_bit_map, high when the word has a free bit
+uint64_t* free_summary = NULL;
+
+uint32_t bitmap_bits = 0;           // the number of blocks tracked
+uint32_t bitmap_words = 0;          // words in free_bit_map, padded to whole disk blocks
+uint32_t bitmap_start = 0;          // the first disk block holding the bit map
+uint32_t bitmap_block_size = 0;
+uint32_t bitmap_nblocks = 0;        // the number of disk blocks holding the bit map
+uint8_t* bitmap_dirty = NULL;       // one flag per bit map block changed since the last flush
+
+uint32_t free_count = 0;            // the number of free blocks
+uint32_t alloc_hint = 0;            // where the next-fit search starts
+alloc_stats_t alloc_stats;
+
+// the allocator lock, guards everything above once the disk is mounted
+pthread_mutex_t bitmap_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* macros */
-#define FREE_BIT(_data, _which_bit) \
-    _data = _data | (1 << _which_bit)
+#define WORD_BITS 64
+
+#define IS_FREE(_index) \
+    ((free_bit_map[(_index) / WORD_BITS] >> ((_index) % WORD_BITS)) & 1)
+
+#define SUMMARY_SET(_word) \
+    free_summary[(_word) / WORD_BITS] |= 1ULL << ((_word) % WORD_BITS)
+
+#define SUMMARY_CLEAR(_word) \
+    free_summary[(_word) / WORD_BITS] &= ~(1ULL << ((_word) % WORD_BITS))
+
+#define MARK_DIRTY(_index) \
+    bitmap_dirty[(_index) / (bitmap_block_size * 8)] = 1
+
+static void use_bit(uint32_t index) {
+    uint32_t w = index / WORD_BITS;
+
+    if (index >= bitmap_bits || !IS_FREE(index))
+        return;
+    free_bit_map[w] &= ~(1ULL << (index % WORD_BITS));
+    if (free_bit_map[w] == 0)
+        SUMMARY_CLEAR(w);
+    --free_count;
+    MARK_DIRTY(index);
+}
+
+static void free_bit(uint32_t index) {
+    uint32_t w = index / WORD_BITS;
+
+    if (index >= bitmap_bits || IS_FREE(index))
+        return;
+    free_bit_map[w] |= 1ULL << (index % WORD_BITS);
+    SUMMARY_SET(w);
+    ++free_count;
+    MARK_DIRTY(index);
+}
+
+/**
+ * Finds the first free block at or after a position
+ *
+ * @param  from the position to start at
+ * @return      the index of the free block, bitmap_bits if there is none
+ */
+static uint32_t next_free(uint32_t from) {
+    if (from >= bitmap_bits)
+        return bitmap_bits;
+
+    // rest of the current word
+    uint32_t w = from / WORD_BITS;
+    uint64_t x = free_bit_map[w] & (~0ULL << (from % WORD_BITS));
+    if (x != 0)
+        return w * WORD_BITS + __builtin_ctzll(x);
+
+    // use the summary to skip words without free bits
+    uint32_t summary_words = (bitmap_words + WORD_BITS - 1) / WORD_BITS;
+    ++w;
+    for (uint32_t s = w / WORD_BITS; s < summary_words; ++s) {
+        uint64_t y = free_summary[s];
+        if (s == w / WORD_BITS)
+            y &= ~0ULL << (w % WORD_BITS);
+        if (y != 0) {
+            w = s * WORD_BITS + __builtin_ctzll(y);
+            return w * WORD_BITS + __builtin_ctzll(free_bit_map[w]);
+        }
+    }
+    return bitmap_bits;
+}
+
+/**
+ * Measures the run of free blocks starting at a free block
+ *
+ * @param  start the first block of the run
+ * @param  max   stop counting after this many blocks
+ * @return       the length of the run, at most max
+ */
+static uint32_t run_length(uint32_t start, uint32_t max) {
+    uint32_t len = 0;
+
+    while (len < max && start + len < bitmap_bits) {
+        uint32_t i = start + len;
+        uint64_t x = free_bit_map[i / WORD_BITS] >> (i % WORD_BITS);
+
+        // count the free bits from i up to the first used one in this word
+        uint32_t ones = ~x == 0 ? WORD_BITS - i % WORD_BITS : (uint32_t) __builtin_ctzll(~x);
+        len += ones;
+        if (i % WORD_BITS + ones < WORD_BITS)
+            break;
+    }
+    if (start + len > bitmap_bits)
+        len = bitmap_bits - start;
+    return len < max ? len : max;
+}
+
+void init_bitmap(uint32_t num_blocks, uint32_t start, uint32_t block_size) {
+    uint32_t bits_per_block = block_size * 8;
+
+    bitmap_bits = num_blocks;
+    bitmap_start = start;
+    bitmap_block_size = block_size;
+    bitmap_nblocks = (num_blocks + bits_per_block - 1) / bits_per_block;
+    bitmap_words = bitmap_nblocks * (block_size / sizeof(uint64_t));
+
+    free(free_bit_map);
+    free(free_summary);
+    free(bitmap_dirty);
+    free_bit_map = malloc(bitmap_words * sizeof(uint64_t));
+    free_summary = calloc((bitmap_words + WORD_BITS - 1) / WORD_BITS, sizeof(uint64_t));
+    bitmap_dirty = malloc(bitmap_nblocks);
+
+    // initialize all bits to high, except the padding past the last block
+    memset(free_bit_map, 0, bitmap_words * sizeof(uint64_t));
+    memset(free_bit_map, 0xFF, num_blocks / WORD_BITS * sizeof(uint64_t));
+    if (num_blocks % WORD_BITS != 0)
+        free_bit_map[num_blocks / WORD_BITS] = (1ULL << (num_blocks % WORD_BITS)) - 1;
+    for (uint32_t w = 0; w < bitmap_words; ++w)
+        if (free_bit_map[w] != 0)
+            SUMMARY_SET(w);
+
+    memset(bitmap_dirty, 1, bitmap_nblocks);
+    free_count = num_blocks;
+    alloc_hint = 0;
+    memset(&alloc_stats, 0, sizeof(alloc_stats));
+}
+
+void load_bitmap() {
+    read_blocks(bitmap_start, bitmap_nblocks, free_bit_map);
+
+    // never hand out the padding past the last block
+    if (bitmap_bits % WORD_BITS != 0)
+        free_bit_map[bitmap_bits / WORD_BITS] &= (1ULL << (bitmap_bits % WORD_BITS)) - 1;
+    for (uint32_t w = (bitmap_bits + WORD_BITS - 1) / WORD_BITS; w < bitmap_words; ++w)
+        free_bit_map[w] = 0;
+
+    // rebuild the summary and the free block count
+    memset(free_summary, 0, (bitmap_words + WORD_BITS - 1) / WORD_BITS * sizeof(uint64_t));
+    free_count = 0;
+    for (uint32_t w = 0; w < bitmap_words; ++w)
+        if (free_bit_map[w] != 0) {
+            SUMMARY_SET(w);
+            free_count += __builtin_popcountll(free_bit_map[w]);
+        }
+
+    memset(bitmap_dirty, 0, bitmap_nblocks);
+    alloc_hint = 0;
+}
+
+void flush_bitmap() {
+    // hand the dirty blocks to the journal, adjacent ones together. The
+    // journal is locked first so that copies of the same block taken by
+    // two threads can't reach it out of order
+    lock_journal();
+    pthread_mutex_lock(&bitmap_lock);
+    for (uint32_t i = 0; i < bitmap_nblocks; ++i) {
+        if (!bitmap_dirty[i])
+            continue;
 
-#define USE_BIT(_data, _which_bit) \
-    _data = _data & ~(1 << _which_bit)
+        uint32_t n = 1;
+        while (i + n < bitmap_nblocks && bitmap_dirty[i + n])
+            ++n;
+        journal_add(bitmap_start + i, n, (char*) free_bit_map + (size_t) i * bitmap_block_size);
+        memset(&bitmap_dirty[i], 0, n);
+        i += n - 1;
+    }
+    pthread_mutex_unlock(&bitmap_lock);
+    unlock_journal();
+}
+
+uint32_t get_free_count() {
+    pthread_mutex_lock(&bitmap_lock);
+    uint32_t count = free_count;
+    pthread_mutex_unlock(&bitmap_lock);
+    return count;
+}
 
 void force_set_index(uint32_t index) {
-    // get index in array of which bit to free
-    uint32_t i = index / 8;
+    pthread_mutex_lock(&bitmap_lock);
+    use_bit(index);
+    pthread_mutex_unlock(&bitmap_lock);
+}
+
+static uint32_t index_run(uint32_t goal, uint32_t count, int search, uint32_t* len) {
+    uint32_t start = bitmap_bits;
+
+    *len = 0;
+    if (free_count == 0 || count == 0)
+        return 0;
+
+    if (goal < bitmap_bits && IS_FREE(goal)) {
+        // the block right after the caller's last one is free, continue there
+        start = goal;
+    } else if (!search) {
+        // an earlier search found no run long enough, take the next free
+        // blocks after the goal rather than searching the whole map again
+        start = next_free(goal < bitmap_bits ? goal : 0);
+        if (start == bitmap_bits)
+            start = next_free(0);
+    } else {
+        // next fit: the first free run of the requested length after the
+        // last allocation, wrapping around once, or the longest free run
+        // found if there is no such run
+        uint32_t best = 0;
+        uint32_t from = alloc_hint < bitmap_bits ? alloc_hint : 0;
 
-    // get which bit to free
-    uint8_t bit = index % 8;
+        ++alloc_stats.scans;
+        for (int pass = 0; pass < 2 && best < count; ++pass) {
+            uint32_t end = pass == 0 ? bitmap_bits : from;
+            uint32_t i = pass == 0 ? from : 0;
 
-    // free bit
-    USE_BIT(free_bit_map[i], bit);
+            while ((i = next_free(i)) < end) {
+                uint32_t run = run_length(i, count);
+                ++alloc_stats.runs;
+                if (run > best) {
+                    start = i;
+                    best = run;
+                    if (run == count)
+                        break;
+                }
+                i += run;
+            }
+        }
+    }
+
+    // take as much of the run as needed
+    *len = run_length(start, count);
+    for (uint32_t i = 0; i < *len; ++i)
+        use_bit(start + i);
+    alloc_hint = start + *len;
+    ++alloc_stats.allocations;
+    alloc_stats.blocks += *len;
+    return start;
 }
 
 uint32_t get_index() {
-    uint32_t i = 0;
+    uint32_t len;
 
-    // find the first section with a free bit
-    // let's ignore overflow for now...
-    while (free_bit_map[i] == 0) { i++; }
+    pthread_mutex_lock(&bitmap_lock);
+    uint32_t index = index_run(alloc_hint, 1, 1, &len);
+    pthread_mutex_unlock(&bitmap_lock);
 
-    // now, find the first free bit
-    // ffs has the lsb as 1, not 0. So we need to subtract
-    uint8_t bit = ffs(free_bit_map[i]) - 1;
+    //return which bit we used
+    return len == 0 ? 0 : index;
+}
 
-    // set the bit to used
-    USE_BIT(free_bit_map[i], bit);
+uint32_t get_index_run(uint32_t goal, uint32_t count, int search, uint32_t* len) {
+    pthread_mutex_lock(&bitmap_lock);
+    uint32_t index = index_run(goal, count, search, len);
+    pthread_mutex_unlock(&bitmap_lock);
+    return index;
+}
 
-    //return which bit we used
-    return i * 8 + bit;
+uint32_t get_index_fit(uint32_t count, uint32_t limit) {
+    uint32_t start = 0;
+
+    pthread_mutex_lock(&bitmap_lock);
+    if (limit > bitmap_bits)
+        limit = bitmap_bits;
+
+    // first fit from the start of the disk, block 0 is never free
+    ++alloc_stats.scans;
+    for (uint32_t i = next_free(0); count > 0 && i < limit && count <= limit - i;) {
+        uint32_t run = run_length(i, count);
+        ++alloc_stats.runs;
+        if (run == count) {
+            start = i;
+            break;
+        }
+        i = next_free(i + run);
+    }
+
+    if (start != 0) {
+        for (uint32_t i = 0; i < count; ++i)
+            use_bit(start + i);
+        ++alloc_stats.allocations;
+        alloc_stats.blocks += count;
+    }
+    pthread_mutex_unlock(&bitmap_lock);
+    return start;
+}
+
+void get_free_extents(uint32_t* extents, uint32_t* largest) {
+    *extents = 0;
+    *largest = 0;
+
+    pthread_mutex_lock(&bitmap_lock);
+    for (uint32_t i = next_free(0); i < bitmap_bits;) {
+        uint32_t run = run_length(i, bitmap_bits);
+        ++*extents;
+        if (run > *largest)
+            *largest = run;
+        i = next_free(i + run);
+    }
+    pthread_mutex_unlock(&bitmap_lock);
 }
 
 void rm_index(uint32_t index) {
-    // get index in array of which bit to free
-    uint32_t i = index / 8;
+    pthread_mutex_lock(&bitmap_lock);
+    free_bit(index);
+    pthread_mutex_unlock(&bitmap_lock);
+}
 
-    // get which bit to free
-    uint8_t bit = index % 8;
+void get_alloc_stats(alloc_stats_t* stats) {
+    pthread_mutex_lock(&bitmap_lock);
+    *stats = alloc_stats;
+    pthread_mutex_unlock(&bitmap_lock);
+}
 
-    // free bit
-    FREE_BIT(free_bit_map[i], bit);
+void reset_alloc_stats() {
+    pthread_mutex_lock(&bitmap_lock);
+    memset(&alloc_stats, 0, sizeof(alloc_stats));
+    pthread_mutex_unlock(&bitmap_lock);
 }
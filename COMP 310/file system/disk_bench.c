@@ -0,0 +1,54 @@
+#include "disk_emu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_DISK "bench_disk.disk"
+#define BENCH_BLOCK_SZ 1024
+
+static double elapsed_ms(struct timespec* start) {
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e3 + (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/**
+ * Creates and closes a fresh disk image
+ *
+ * @param  type     DISK_IMAGE_SPARSE or DISK_IMAGE_PREALLOC
+ * @param  size_mib the size of the image in MiB
+ * @return          the time it took in milliseconds, -1 on failure
+ */
+static double format_ms(int type, long size_mib) {
+    struct timespec start;
+    double ms;
+
+    set_disk_image_type(type);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (init_fresh_disk(BENCH_DISK, BENCH_BLOCK_SZ, size_mib * (1024 * 1024 / BENCH_BLOCK_SZ)) != 0)
+        return -1;
+    close_disk();
+    ms = elapsed_ms(&start);
+
+    unlink(BENCH_DISK);
+    return ms;
+}
+
+/**
+ * Times the creation of fresh disk images of growing sizes,
+ * sparse and preallocated, from 16 MiB up to the given size
+ *
+ * usage: disk_bench [max size in MiB, default 4096]
+ */
+int main(int argc, char *argv[]) {
+    long max_mib = argc > 1 ? atol(argv[1]) : 4096;
+
+    printf("%10s %12s %14s\n", "size MiB", "sparse ms", "prealloc ms");
+    for (long size = 16; size <= max_mib; size *= 2)
+        printf("%10ld %12.3f %14.3f\n", size,
+               format_ms(DISK_IMAGE_SPARSE, size), format_ms(DISK_IMAGE_PREALLOC, size));
+    return 0;
+}
@@ -1,15 +1,1309 @@
 #include <stdio.h>
-#include <stdlib.h> 
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include "disk_emu.h"
 
 
 FILE* fp = NULL;
-double L, p;
-double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY, lru;
+int BLOCK_SIZE, MAX_BLOCK;
+int backend = DISK_BACKEND_PIO;
+int image_type = DISK_IMAGE_SPARSE;
+
+/*Mapping of the whole disk file in DISK_BACKEND_MMAP mode*/
+char* disk_map = NULL;
+size_t disk_map_len = 0;
+
+/*The stdio backend shares the file position of fp, so its*/
+/*seek and transfer have to happen together               */
+pthread_mutex_t stdio_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/*Dirty blocks cache_insert tries to write back before giving up*/
+#define CACHE_EVICT_TRIES 4
+
+/*-----------------------------------------------------------*/
+/*LRU block cache sitting between the API and the disk file. */
+/*Writes are kept in the cache (write-back) until the block  */
+/*is evicted or the disk is flushed.                         */
+/*-----------------------------------------------------------*/
+typedef struct cache_entry {
+    int block;                  /*block address held by this entry*/
+    int dirty;                  /*1 if the entry differs from the disk file*/
+    int prefetched;             /*1 if read by prefetch_blocks and not used since*/
+    char* data;
+    struct cache_entry* prev;   /*LRU list, most recently used first*/
+    struct cache_entry* next;
+    struct cache_entry* hnext;  /*hash bucket chain*/
+} cache_entry;
+
+int cache_capacity = DEFAULT_CACHE_BLOCKS;
+int cache_used = 0;
+cache_entry* cache_entries = NULL;
+char* cache_data = NULL;
+cache_entry** cache_buckets = NULL;
+int cache_nbuckets = 0;
+cache_entry* lru = NULL;        /*most recently used*/
+cache_entry* lru_tail = NULL;   /*least recently used*/
+cache_stats_t cache_stats;
+
+/*Adds to a counter. Every counter is updated this way, some without*/
+/*the cache lock, and read with atomic loads by get_cache_stats      */
+#define STAT_ADD(_field, _n) __atomic_add_fetch(&cache_stats._field, (_n), __ATOMIC_RELAXED)
+
+/*Guards the cache. Disk reads for blocks missing from the cache are*/
+/*made without it, so that threads reading different blocks wait on */
+/*the disk file in parallel.                                        */
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+unsigned long cache_epoch = 0;  /*counts the calls to write_blocks*/
+
+/*-----------------------------------------------------------*/
+/*Asynchronous requests, run by a pool of worker threads     */
+/*through read_blocks and write_blocks. Without workers they */
+/*run synchronously in submit_io.                            */
+/*-----------------------------------------------------------*/
+int io_threads = DEFAULT_IO_THREADS;
+int io_depth = DEFAULT_IO_DEPTH;
+pthread_t* io_workers = NULL;
+disk_request** io_active = NULL;    /*the request each worker is running, NULL while idle*/
+int io_running = 0;             /*workers started*/
+int io_stop = 0;
+disk_request* io_head = NULL;   /*submission queue, oldest first*/
+disk_request* io_tail = NULL;
+int io_pending = 0;             /*submitted and not completed*/
+pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t io_submitted = PTHREAD_COND_INITIALIZER;
+pthread_cond_t io_completed = PTHREAD_COND_INITIALIZER;
+pthread_once_t io_fork_once = PTHREAD_ONCE_INIT;
+
+/*-----------------------------------------------------------*/
+/*Device model: what the requests made on the disk file would*/
+/*cost on a real device, charged to cache_stats.device_ns.   */
+/*The time charged only depends on the order of the requests,*/
+/*so runs making the same requests in the same order can be  */
+/*compared. With io threads and prefetches the scheduler     */
+/*picks the order, set_io_threads(0) keeps the callers' one. */
+/*-----------------------------------------------------------*/
+disk_model_t model;             /*all 0, requests are free*/
+int model_on = 0;               /*1 if the model charges anything*/
+int model_set = 0;              /*1 once set_disk_model was called, SFS_DISK_MODEL is ignored then*/
+int model_head = 0;             /*the block following the last request*/
+unsigned long long model_rng = 1;   /*state of the failure draws*/
+pthread_mutex_t model_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*Starting points for parse_disk_model*/
+static const struct {
+    const char* name;
+    disk_model_t model;
+} model_profiles[] = {
+    {"none", {0, 0, 0, 0, 0, 3, 0, 1}},
+    /*7200 rpm disk: 15 ms full stroke seek, half a turn to wait, 150 MB/s*/
+    {"hdd", {50000, 15000000, 4170000, 150000000, 0, 3, 0, 1}},
+    /*SATA flash disk: no positioning, 500 MB/s*/
+    {"ssd", {60000, 0, 0, 500000000, 0, 3, 0, 1}},
+};
+
+/*-----------------------------------------------------*/
+/*Returns 1 if a model charges anything for a request  */
+/*-----------------------------------------------------*/
+static int model_active(const disk_model_t *m)
+{
+    return m->request_ns > 0 || m->seek_ns > 0 || m->rotate_ns > 0 || m->bandwidth > 0 || m->fail_rate > 0;
+}
+
+/*-------------------------------------------------------*/
+/*Draws a number in [0, 1) for the failures, xorshift64* */
+/*-------------------------------------------------------*/
+static double model_draw()
+{
+    model_rng ^= model_rng >> 12;
+    model_rng ^= model_rng << 25;
+    model_rng ^= model_rng >> 27;
+    return (double) ((model_rng * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+/*-----------------------------------------------------------*/
+/*Sets up the model for a disk being opened: from the        */
+/*SFS_DISK_MODEL environment variable (see parse_disk_model) */
+/*unless set_disk_model was called, with the head at block 0 */
+/*and the failure draws started over                         */
+/*-----------------------------------------------------------*/
+static void model_init()
+{
+    disk_model_t env;
+    char* spec = getenv("SFS_DISK_MODEL");
+
+    pthread_mutex_lock(&model_lock);
+    if (!model_set && spec != NULL)
+    {
+        if (parse_disk_model(spec, &env) == 0)
+            model = env;
+        else
+            printf("ignoring bad SFS_DISK_MODEL %s\n", spec);
+    }
+    model_head = 0;
+    model_rng = model.seed != 0 ? model.seed : 1;
+    __atomic_store_n(&model_on, model_active(&model), __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&model_lock);
+}
+
+/*--------------------------------------------------------------*/
+/*Charges a request on the disk file to the device model: a     */
+/*fixed cost, a seek in proportion to the distance from the end */
+/*of the previous request and a wait for the disk to turn when  */
+/*it doesn't start there, and the transfer. Each attempt may    */
+/*fail and be retried, at the same cost. Returns 0, or -1 if    */
+/*every attempt failed, in which case the request isn't made.   */
+/*--------------------------------------------------------------*/
+static int model_request(int start_address, int nblocks)
+{
+    unsigned long cost = 0;
+    int distance, failed, sleeps, retries = 0;
+    struct timespec delay;
+
+    if (!__atomic_load_n(&model_on, __ATOMIC_RELAXED))
+        return 0;
+
+    pthread_mutex_lock(&model_lock);
+    for (;;)
+    {
+        cost += model.request_ns;
+        distance = abs(start_address - model_head);
+        if (distance > 0)
+            cost += (unsigned long) ((double) model.seek_ns * distance / MAX_BLOCK) + model.rotate_ns;
+        if (model.bandwidth > 0)
+            cost += (unsigned long) ((double) nblocks * BLOCK_SIZE * 1e9 / model.bandwidth);
+        model_head = start_address + nblocks;
+
+        failed = model.fail_rate > 0 && model_draw() < model.fail_rate;
+        if (!failed || retries == model.max_retries)
+            break;
+        retries++;
+    }
+    sleeps = model.sleep;
+    pthread_mutex_unlock(&model_lock);
+
+    STAT_ADD(device_ns, cost);
+    STAT_ADD(device_retries, retries);
+    if (sleeps)
+    {
+        delay.tv_sec = cost / 1000000000UL;
+        delay.tv_nsec = cost % 1000000000UL;
+        while (nanosleep(&delay, &delay) < 0 && errno == EINTR)
+            ;
+    }
+    if (failed)
+    {
+        STAT_ADD(device_errors, 1);
+        printf("device error at block %d after %d retries\n", start_address, retries);
+        return -1;
+    }
+    return 0;
+}
+
+/*--------------------------------------------------------------*/
+/*Sets the cost model of the device, for the requests made from */
+/*now on. Without a call, the model comes from the environment  */
+/*variable SFS_DISK_MODEL when a disk is opened, if it is set.  */
+/*Returns -1 if the failure rate isn't between 0 and 1 or the   */
+/*number of retries is negative.                                */
+/*--------------------------------------------------------------*/
+int set_disk_model(const disk_model_t *m)
+{
+    if (m->fail_rate < 0 || m->fail_rate > 1 || m->max_retries < 0)
+        return -1;
+
+    pthread_mutex_lock(&model_lock);
+    model = *m;
+    model_set = 1;
+    model_rng = model.seed != 0 ? model.seed : 1;
+    __atomic_store_n(&model_on, model_active(&model), __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&model_lock);
+    return 0;
+}
+
+void get_disk_model(disk_model_t *m)
+{
+    pthread_mutex_lock(&model_lock);
+    *m = model;
+    pthread_mutex_unlock(&model_lock);
+}
+
+/*--------------------------------------------------------------*/
+/*Parses a model written as items separated by ',' or ':', each */
+/*either a profile (none, hdd or ssd) or key=value with the key */
+/*a field of disk_model_t, e.g. "hdd,fail_rate=0.001". Later    */
+/*items override earlier ones, the fields not given are those of*/
+/*"none". Returns -1 for an unknown item or a bad value.        */
+/*--------------------------------------------------------------*/
+int parse_disk_model(const char *spec, disk_model_t *m)
+{
+    char *copy, *item, *value, *end, *save = NULL;
+    double number;
+    size_t i;
+    int res = 0;
+
+    *m = model_profiles[0].model;
+    copy = strdup(spec);
+    for (item = strtok_r(copy, ",:", &save); item != NULL && res == 0; item = strtok_r(NULL, ",:", &save))
+    {
+        value = strchr(item, '=');
+        if (value == NULL)
+        {
+            res = -1;
+            for (i = 0; i < sizeof(model_profiles) / sizeof(model_profiles[0]); i++)
+                if (strcmp(item, model_profiles[i].name) == 0)
+                {
+                    *m = model_profiles[i].model;
+                    res = 0;
+                }
+            continue;
+        }
+
+        *value++ = '\0';
+        number = strtod(value, &end);
+        if (*value == '\0' || *end != '\0' || number < 0)
+            res = -1;
+        else if (strcmp(item, "request_ns") == 0)
+            m->request_ns = number;
+        else if (strcmp(item, "seek_ns") == 0)
+            m->seek_ns = number;
+        else if (strcmp(item, "rotate_ns") == 0)
+            m->rotate_ns = number;
+        else if (strcmp(item, "bandwidth") == 0)
+            m->bandwidth = number;
+        else if (strcmp(item, "fail_rate") == 0 && number <= 1)
+            m->fail_rate = number;
+        else if (strcmp(item, "max_retries") == 0)
+            m->max_retries = number;
+        else if (strcmp(item, "sleep") == 0)
+            m->sleep = number != 0;
+        else if (strcmp(item, "seed") == 0)
+            m->seed = number;
+        else
+            res = -1;
+    }
+    free(copy);
+    return res;
+}
+
+/*--------------------------------------------------------*/
+/*Reads blocks through stdio, one fread for the whole run */
+/*straight into the buffer. Returns the number of blocks  */
+/*read, -1 if the read came up short.                     */
+/*--------------------------------------------------------*/
+static int stdio_read(int start_address, int nblocks, void *buffer)
+{
+    size_t n;
+
+    /*Goto the data requested from the disk*/
+    fseeko(fp, (off_t) start_address * BLOCK_SIZE, SEEK_SET);
+    STAT_ADD(syscalls, 2);
+
+    n = fread(buffer, BLOCK_SIZE, nblocks, fp);
+    if (n < (size_t) nblocks)
+        return -1;
+    return nblocks;
+}
+
+/*-------------------------------------------------------*/
+/*Writes blocks through stdio, one fwrite per block      */
+/*-------------------------------------------------------*/
+static int stdio_write(int start_address, int nblocks, void *buffer)
+{
+    int i, e, s;
+    e = 0;
+    s = 0;
+
+    void* blockWrite = (void*) malloc(BLOCK_SIZE);
+
+    /*Goto where the data is to be written on the disk*/
+    fseeko(fp, (off_t) start_address * BLOCK_SIZE, SEEK_SET);
+    STAT_ADD(syscalls, 1 + 2 * nblocks);
+
+    /*For every block requested*/
+    for (i = 0; i < nblocks; ++i)
+    {
+        memcpy(blockWrite, buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
+
+        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
+        fflush(fp);
+        s++;
+    }
+    free(blockWrite);
+
+    /*If no failure return the number of blocks written, else return the negative number of failures*/
+    if (e == 0)
+        return s;
+    else
+        return e;
+}
+
+/*-------------------------------------------------------------*/
+/*Reads a range of blocks with a single positional read. Parts */
+/*past the end of the file read back as 0's.                   */
+/*-------------------------------------------------------------*/
+static int pio_read(int start_address, int nblocks, void *buffer)
+{
+    size_t done = 0;
+    size_t len = (size_t) nblocks * BLOCK_SIZE;
+    off_t offset = (off_t) start_address * BLOCK_SIZE;
+    ssize_t n;
+
+    while (done < len)
+    {
+        n = pread(fileno(fp), (char*) buffer + done, len - done, offset + done);
+        STAT_ADD(syscalls, 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            printf("read error at block %d\n", start_address);
+            return -1;
+        }
+        if (n == 0)
+        {
+            memset((char*) buffer + done, 0, len - done);
+            break;
+        }
+        done += n;
+    }
+    return nblocks;
+}
+
+/*----------------------------------------------------*/
+/*Writes len bytes at the given offset, retrying short */
+/*or interrupted writes                                */
+/*----------------------------------------------------*/
+static int pwrite_all(const char *buffer, size_t len, off_t offset)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = pwrite(fileno(fp), buffer, len, offset);
+        STAT_ADD(syscalls, 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        buffer += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*---------------------------------------------------*/
+/*Writes a range of blocks with a single positional  */
+/*write                                              */
+/*---------------------------------------------------*/
+static int pio_write(int start_address, int nblocks, void *buffer)
+{
+    if (pwrite_all(buffer, (size_t) nblocks * BLOCK_SIZE, (off_t) start_address * BLOCK_SIZE) < 0)
+    {
+        printf("write error at block %d\n", start_address);
+        return -1;
+    }
+    return nblocks;
+}
+
+/*------------------------------------------------------------*/
+/*Writes blocks gathered from several buffers, one block per  */
+/*buffer, starting at the given address. Each run of up to    */
+/*IOV_MAX blocks is a single positional write.                */
+/*------------------------------------------------------------*/
+static int pio_writev(int start_address, struct iovec *iov, int iovcnt)
+{
+    int i, j, cnt;
+    ssize_t n;
+    off_t offset;
+
+    for (i = 0; i < iovcnt; i += cnt)
+    {
+        cnt = iovcnt - i < IOV_MAX ? iovcnt - i : IOV_MAX;
+        offset = (off_t) (start_address + i) * BLOCK_SIZE;
+
+        n = pwritev(fileno(fp), iov + i, cnt, offset);
+        STAT_ADD(syscalls, 1);
+        if (n < 0 && errno != EINTR)
+        {
+            printf("write error at block %d\n", start_address + i);
+            return -1;
+        }
+        if (n < 0)
+            n = 0;
+
+        /*Short write, finish the rest of the run block by block*/
+        for (j = n / BLOCK_SIZE; j < cnt && n < (ssize_t) cnt * BLOCK_SIZE; j++)
+        {
+            size_t part = j == n / BLOCK_SIZE ? n % BLOCK_SIZE : 0;
+
+            if (pwrite_all((char*) iov[i + j].iov_base + part, BLOCK_SIZE - part,
+                           offset + (off_t) j * BLOCK_SIZE + part) < 0)
+            {
+                printf("write error at block %d\n", start_address + i + j);
+                return -1;
+            }
+        }
+    }
+    return iovcnt;
+}
+
+/*-----------------------------------------------*/
+/*Reads blocks from the disk file using the      */
+/*selected backend, bypassing the cache          */
+/*-----------------------------------------------*/
+static int disk_read(int start_address, int nblocks, void *buffer)
+{
+    int res;
+
+    if (model_request(start_address, nblocks) < 0)
+        return -1;
+    if (backend != DISK_BACKEND_STDIO)
+        return pio_read(start_address, nblocks, buffer);
+
+    pthread_mutex_lock(&stdio_lock);
+    res = stdio_read(start_address, nblocks, buffer);
+    pthread_mutex_unlock(&stdio_lock);
+    return res;
+}
+
+static int disk_write(int start_address, int nblocks, void *buffer)
+{
+    int res;
+
+    if (model_request(start_address, nblocks) < 0)
+        return -1;
+    if (backend != DISK_BACKEND_STDIO)
+        return pio_write(start_address, nblocks, buffer);
+
+    pthread_mutex_lock(&stdio_lock);
+    res = stdio_write(start_address, nblocks, buffer);
+    pthread_mutex_unlock(&stdio_lock);
+    return res;
+}
+
+static int disk_writev(int start_address, struct iovec *iov, int iovcnt)
+{
+    int i, res = iovcnt;
+
+    if (model_request(start_address, iovcnt) < 0)
+        return -1;
+    if (backend != DISK_BACKEND_STDIO)
+        return pio_writev(start_address, iov, iovcnt);
+
+    pthread_mutex_lock(&stdio_lock);
+    for (i = 0; i < iovcnt && res >= 0; i++)
+        if (stdio_write(start_address + i, 1, iov[i].iov_base) < 0)
+            res = -1;
+    pthread_mutex_unlock(&stdio_lock);
+    return res;
+}
+
+/*----------------------------------------------------------*/
+/*Selects how blocks are moved to and from the disk file.   */
+/*Must be called while no disk is open.                     */
+/*----------------------------------------------------------*/
+int set_disk_backend(int type)
+{
+    if (fp != NULL || type < DISK_BACKEND_STDIO || type > DISK_BACKEND_MMAP)
+        return -1;
+    backend = type;
+    return 0;
+}
+
+/*-----------------------------------------------------------*/
+/*Maps the whole disk file into memory, growing the file to  */
+/*its full size first if it is shorter                       */
+/*-----------------------------------------------------------*/
+static int map_disk()
+{
+    struct stat st;
+
+    disk_map_len = (size_t) MAX_BLOCK * BLOCK_SIZE;
+    if (fstat(fileno(fp), &st) < 0)
+        return -1;
+    if ((size_t) st.st_size < disk_map_len && ftruncate(fileno(fp), disk_map_len) < 0)
+        return -1;
+
+    disk_map = mmap(NULL, disk_map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fp), 0);
+    if (disk_map == MAP_FAILED)
+    {
+        disk_map = NULL;
+        printf("Could not map the disk file\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void unmap_disk()
+{
+    if (disk_map != NULL)
+    {
+        munmap(disk_map, disk_map_len);
+        disk_map = NULL;
+    }
+}
+
+/*-------------------------------------------------------------*/
+/*Selects how init_fresh_disk creates the disk file            */
+/*-------------------------------------------------------------*/
+int set_disk_image_type(int type)
+{
+    if (type != DISK_IMAGE_SPARSE && type != DISK_IMAGE_PREALLOC)
+        return -1;
+    image_type = type;
+    return 0;
+}
+
+/*-------------------------------------------------------------*/
+/*Returns a pointer to the contents of a block, valid until    */
+/*the disk is closed. Changes made through it reach the disk   */
+/*file on the next flush. Only available in DISK_BACKEND_MMAP  */
+/*mode, NULL otherwise.                                        */
+/*-------------------------------------------------------------*/
+void* get_block_ptr(int address)
+{
+    if (disk_map == NULL || address < 0 || address >= MAX_BLOCK)
+        return NULL;
+    return disk_map + (size_t) address * BLOCK_SIZE;
+}
+
+/*----------------------------------------*/
+/*Finds the cache entry holding a block   */
+/*----------------------------------------*/
+static cache_entry* cache_lookup(int block)
+{
+    cache_entry* c = cache_buckets[block & (cache_nbuckets - 1)];
+
+    while (c != NULL && c->block != block)
+        c = c->hnext;
+    return c;
+}
+
+static void lru_unlink(cache_entry* c)
+{
+    if (c->prev != NULL)
+        c->prev->next = c->next;
+    else
+        lru = c->next;
+    if (c->next != NULL)
+        c->next->prev = c->prev;
+    else
+        lru_tail = c->prev;
+}
+
+static void lru_push_front(cache_entry* c)
+{
+    c->prev = NULL;
+    c->next = lru;
+    if (lru != NULL)
+        lru->prev = c;
+    lru = c;
+    if (lru_tail == NULL)
+        lru_tail = c;
+}
+
+static void lru_push_back(cache_entry* c)
+{
+    c->next = NULL;
+    c->prev = lru_tail;
+    if (lru_tail != NULL)
+        lru_tail->next = c;
+    lru_tail = c;
+    if (lru == NULL)
+        lru = c;
+}
+
+static void hash_unlink(cache_entry* c)
+{
+    cache_entry** link = &cache_buckets[c->block & (cache_nbuckets - 1)];
+
+    while (*link != c)
+        link = &(*link)->hnext;
+    *link = c->hnext;
+}
+
+/*-----------------------------------------------------------*/
+/*Gets an entry for a new block, evicting the least recently */
+/*used one (and writing it back if dirty) when the cache is  */
+/*full. A dirty block whose writeback fails stays cached and */
+/*dirty, and the next one is tried instead. Returns NULL if  */
+/*no entry could be freed.                                   */
+/*-----------------------------------------------------------*/
+static cache_entry* cache_insert(int block)
+{
+    cache_entry* c;
+    int tries = 0;
+
+    if (cache_used < cache_capacity)
+    {
+        c = &cache_entries[cache_used++];
+    }
+    else
+    {
+        for (c = lru_tail; c != NULL && c->dirty; c = c->prev)
+        {
+            if (tries++ == CACHE_EVICT_TRIES)
+                return NULL;
+            if (disk_write(c->block, 1, c->data) >= 0)
+            {
+                c->dirty = 0;
+                STAT_ADD(writebacks, 1);
+                break;
+            }
+        }
+        if (c == NULL)
+            return NULL;
+
+        lru_unlink(c);
+        /*Entries dropped by invalidate_blocks hold no block*/
+        if (c->block >= 0)
+        {
+            hash_unlink(c);
+            STAT_ADD(evictions, 1);
+        }
+        if (c->prefetched)
+            STAT_ADD(prefetch_wasted, 1);
+    }
+
+    c->block = block;
+    c->dirty = 0;
+    c->prefetched = 0;
+    c->hnext = cache_buckets[block & (cache_nbuckets - 1)];
+    cache_buckets[block & (cache_nbuckets - 1)] = c;
+    lru_push_front(c);
+    return c;
+}
+
+static int compare_entries(const void* a, const void* b)
+{
+    return (*(cache_entry**) a)->block - (*(cache_entry**) b)->block;
+}
+
+/*--------------------------------------------------------------*/
+/*Empties the stdio buffer of the disk file and waits for the   */
+/*data written to it to reach the storage. Returns -1 on error. */
+/*--------------------------------------------------------------*/
+static int sync_disk_file()
+{
+    int res;
+
+    pthread_mutex_lock(&stdio_lock);
+    res = fflush(fp);
+    pthread_mutex_unlock(&stdio_lock);
+    STAT_ADD(syscalls, 1);
+    if (fdatasync(fileno(fp)) < 0)
+        res = -1;
+    return res;
+}
+
+/*------------------------------------------------------------*/
+/*Writes every dirty cached block back to the disk file and   */
+/*makes the file durable with fdatasync (msync when it is     */
+/*mapped), so that what was flushed reaches the storage before*/
+/*any later write. Blocks are written in address order and    */
+/*adjacent ones are merged into a single write, the blocks    */
+/*written are counted in cache_stats.writebacks. Returns 0, or*/
+/*-1 if a write or the sync failed, the blocks a failed write */
+/*held stay dirty then.                                       */
+/*------------------------------------------------------------*/
+int flush_disk()
+{
+    int i, j, n, count, res;
+    cache_entry** dirty;
+    struct iovec* iov;
+
+    if (fp == NULL)
+        return -1;
+    /*Writes still queued would miss the flush*/
+    drain_io();
+    STAT_ADD(syscalls, 1);
+    if (disk_map != NULL)
+        return msync(disk_map, disk_map_len, MS_SYNC);
+    if (cache_entries == NULL)
+        return sync_disk_file();
+
+    pthread_mutex_lock(&cache_lock);
+    dirty = (cache_entry**) malloc(cache_used * sizeof(cache_entry*));
+    iov = (struct iovec*) malloc(cache_used * sizeof(struct iovec));
+    count = 0;
+    for (i = 0; i < cache_used; i++)
+        if (cache_entries[i].dirty)
+            dirty[count++] = &cache_entries[i];
+    qsort(dirty, count, sizeof(cache_entry*), compare_entries);
+
+    res = 0;
+    for (i = 0; i < count; i += n)
+    {
+        for (n = 1; i + n < count && dirty[i + n]->block == dirty[i]->block + n; n++)
+            ;
+        for (j = 0; j < n; j++)
+        {
+            iov[j].iov_base = dirty[i + j]->data;
+            iov[j].iov_len = BLOCK_SIZE;
+        }
+        if (disk_writev(dirty[i]->block, iov, n) < 0)
+        {
+            res = -1;
+            continue;
+        }
+        for (j = 0; j < n; j++)
+            dirty[i + j]->dirty = 0;
+        STAT_ADD(writebacks, n);
+    }
+
+    free(iov);
+    free(dirty);
+    pthread_mutex_unlock(&cache_lock);
+
+    if (sync_disk_file() < 0)
+        res = -1;
+    return res;
+}
+
+/*-------------------------------------------------------------*/
+/*Returns the descriptor of the disk file, for callers moving  */
+/*block data with it directly (e.g. with splice) at the byte   */
+/*position block * block size. The blocks must be synced with  */
+/*sync_blocks first, and invalidated with invalidate_blocks    */
+/*after writing them. -1 for DISK_BACKEND_STDIO, whose buffered*/
+/*stream can't be bypassed.                                    */
+/*-------------------------------------------------------------*/
+int get_disk_fd()
+{
+    if (fp == NULL || backend == DISK_BACKEND_STDIO)
+        return -1;
+    return fileno(fp);
+}
+
+/*------------------------------------------------------------*/
+/*Writes the dirty cached blocks of a range back to the disk  */
+/*file, so that it holds their latest contents. Returns -1 if */
+/*a write failed, the block stays dirty then.                 */
+/*------------------------------------------------------------*/
+int sync_blocks(int start_address, int nblocks)
+{
+    int i, res = 0;
+    cache_entry* c;
+
+    if (cache_entries == NULL)
+        return 0;
+
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < nblocks; i++)
+    {
+        c = cache_lookup(start_address + i);
+        if (c != NULL && c->dirty)
+        {
+            if (disk_write(c->block, 1, c->data) < 0)
+            {
+                res = -1;
+                continue;
+            }
+            c->dirty = 0;
+            STAT_ADD(writebacks, 1);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return res;
+}
+
+/*------------------------------------------------------------*/
+/*Drops the cached copies of a range of blocks, without       */
+/*writing them back, after the disk file was written directly */
+/*------------------------------------------------------------*/
+int invalidate_blocks(int start_address, int nblocks)
+{
+    int i;
+    cache_entry* c;
+
+    if (cache_entries == NULL)
+        return 0;
+
+    pthread_mutex_lock(&cache_lock);
+    /*A read that missed meanwhile may hold the old contents*/
+    cache_epoch++;
+    for (i = 0; i < nblocks; i++)
+    {
+        c = cache_lookup(start_address + i);
+        if (c != NULL)
+        {
+            hash_unlink(c);
+            lru_unlink(c);
+            lru_push_back(c);
+            if (c->prefetched)
+                STAT_ADD(prefetch_wasted, 1);
+            c->block = -1;
+            c->dirty = 0;
+            c->prefetched = 0;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+/*-------------------------------------------------------------*/
+/*Releases the cache. Dirty blocks must be flushed beforehand. */
+/*-------------------------------------------------------------*/
+static void cache_destroy()
+{
+    free(cache_entries);
+    free(cache_data);
+    free(cache_buckets);
+    cache_entries = NULL;
+    cache_data = NULL;
+    cache_buckets = NULL;
+    cache_used = 0;
+    lru = NULL;
+    lru_tail = NULL;
+}
+
+/*---------------------------------------------------------*/
+/*Allocates the cache for the disk that was just opened    */
+/*---------------------------------------------------------*/
+static void cache_create()
+{
+    int i;
+
+    cache_destroy();
+    /*A mapped disk is already served from memory*/
+    if (cache_capacity <= 0 || disk_map != NULL)
+        return;
+
+    /*Use a power of two bucket count, at least twice the capacity*/
+    for (cache_nbuckets = 1; cache_nbuckets < 2 * cache_capacity; cache_nbuckets <<= 1)
+        ;
+
+    cache_entries = (cache_entry*) calloc(cache_capacity, sizeof(cache_entry));
+    cache_data = (char*) malloc((size_t) cache_capacity * BLOCK_SIZE);
+    cache_buckets = (cache_entry**) calloc(cache_nbuckets, sizeof(cache_entry*));
+    if (cache_entries == NULL || cache_data == NULL || cache_buckets == NULL)
+    {
+        printf("Could not allocate a block cache of %d blocks\n", cache_capacity);
+        cache_destroy();
+        return;
+    }
+    for (i = 0; i < cache_capacity; i++)
+        cache_entries[i].data = cache_data + (size_t) i * BLOCK_SIZE;
+}
+
+/*--------------------------------------------------------------*/
+/*Sets the number of blocks held by the cache, 0 disables it.   */
+/*Takes effect immediately if a disk is open.                   */
+/*--------------------------------------------------------------*/
+int set_cache_size(int num_blocks)
+{
+    if (num_blocks < 0)
+        return -1;
+
+    if (fp != NULL)
+        flush_disk();
+    cache_capacity = num_blocks;
+    if (fp != NULL)
+        cache_create();
+    return 0;
+}
+
+/*------------------------------------------------------*/
+/*Returns the number of blocks the cache holds, 0 if the */
+/*disk is used without one                               */
+/*------------------------------------------------------*/
+int get_cache_size()
+{
+    return disk_map != NULL ? 0 : cache_capacity;
+}
+
+void get_cache_stats(cache_stats_t* stats)
+{
+    size_t i;
+
+    /*Every counter is an unsigned long, updated with STAT_ADD*/
+    for (i = 0; i < sizeof(cache_stats) / sizeof(unsigned long); i++)
+        ((unsigned long*) stats)[i] = __atomic_load_n((unsigned long*) &cache_stats + i, __ATOMIC_RELAXED);
+}
+
+void reset_cache_stats()
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(cache_stats) / sizeof(unsigned long); i++)
+        __atomic_store_n((unsigned long*) &cache_stats + i, 0, __ATOMIC_RELAXED);
+}
+
+/*------------------------------------------------*/
+/*Runs a request the way the caller would have    */
+/*------------------------------------------------*/
+static void cache_prefetch(int start_address, int nblocks);
+
+static void run_request(disk_request* req)
+{
+    if (req->op == DISK_OP_PREFETCH)
+        cache_prefetch(req->start_address, req->nblocks);
+    else if (req->op == DISK_OP_READ)
+        req->result = read_blocks(req->start_address, req->nblocks, req->buffer);
+    else
+        req->result = write_blocks(req->start_address, req->nblocks, req->buffer);
+}
+
+/*---------------------------------------------------------*/
+/*Completes a request with a result, a prefetch is freed   */
+/*as nobody waits for it. Called with io_lock held.        */
+/*---------------------------------------------------------*/
+static void complete_request(disk_request* req, int result)
+{
+    if (req->op == DISK_OP_PREFETCH)
+    {
+        free(req);
+        return;
+    }
+    req->result = result;
+    req->done = 1;
+}
+
+static void* io_worker(void* arg)
+{
+    disk_request* req;
+    int id = (int) (long) arg;
+
+    pthread_mutex_lock(&io_lock);
+    for (;;)
+    {
+        while (io_head == NULL && !io_stop)
+            pthread_cond_wait(&io_submitted, &io_lock);
+        if (io_head == NULL)
+            break;
+
+        req = io_head;
+        io_head = req->next;
+        if (io_head == NULL)
+            io_tail = NULL;
+        io_active[id] = req;
+        pthread_mutex_unlock(&io_lock);
+
+        run_request(req);
+
+        pthread_mutex_lock(&io_lock);
+        io_active[id] = NULL;
+        complete_request(req, req->result);
+        io_pending--;
+        pthread_cond_broadcast(&io_completed);
+    }
+    pthread_mutex_unlock(&io_lock);
+    return NULL;
+}
+
+/*----------------------------------------------------------------*/
+/*A child forked while the workers run has none of them: it gets  */
+/*the locks unlocked and an empty queue, and runs its requests    */
+/*synchronously until the workers are started again, e.g. by the  */
+/*next init_disk. The requests queued or running at the fork are  */
+/*failed, as no worker of the child will complete them.           */
+/*----------------------------------------------------------------*/
+static void io_fork_prepare()
+{
+    pthread_mutex_lock(&io_lock);
+    pthread_mutex_lock(&cache_lock);
+    pthread_mutex_lock(&model_lock);
+}
+
+static void io_fork_parent()
+{
+    pthread_mutex_unlock(&model_lock);
+    pthread_mutex_unlock(&cache_lock);
+    pthread_mutex_unlock(&io_lock);
+}
+
+static void io_fork_child()
+{
+    disk_request* req;
+    disk_request* next;
+    int i;
+
+    for (req = io_head; req != NULL; req = next)
+    {
+        next = req->next;
+        complete_request(req, -1);
+    }
+    for (i = 0; i < io_running; i++)
+        if (io_active[i] != NULL)
+            complete_request(io_active[i], -1);
+    io_head = NULL;
+    io_tail = NULL;
+    io_pending = 0;
+    free(io_workers);
+    free(io_active);
+    io_workers = NULL;
+    io_active = NULL;
+    io_running = 0;
+    io_stop = 0;
+    pthread_cond_init(&io_submitted, NULL);
+    pthread_cond_init(&io_completed, NULL);
+    io_fork_parent();
+}
+
+static void io_register_fork()
+{
+    pthread_atfork(io_fork_prepare, io_fork_parent, io_fork_child);
+}
+
+static void start_io()
+{
+    int i;
+
+    pthread_once(&io_fork_once, io_register_fork);
+    if (io_running > 0 || io_threads <= 0)
+        return;
+    io_stop = 0;
+    io_workers = (pthread_t*) malloc(io_threads * sizeof(pthread_t));
+    io_active = (disk_request**) calloc(io_threads, sizeof(disk_request*));
+    if (io_workers == NULL || io_active == NULL)
+    {
+        free(io_workers);
+        free(io_active);
+        io_workers = NULL;
+        io_active = NULL;
+        return;
+    }
+    for (i = 0; i < io_threads; i++)
+    {
+        if (pthread_create(&io_workers[i], NULL, io_worker, (void*) (long) i) != 0)
+            break;
+        io_running++;
+    }
+}
+
+/*-------------------------------------------------*/
+/*Stops the workers once the queue is empty        */
+/*-------------------------------------------------*/
+static void stop_io()
+{
+    int i;
+
+    pthread_mutex_lock(&io_lock);
+    io_stop = 1;
+    pthread_cond_broadcast(&io_submitted);
+    pthread_mutex_unlock(&io_lock);
+    for (i = 0; i < io_running; i++)
+        pthread_join(io_workers[i], NULL);
+    free(io_workers);
+    free(io_active);
+    io_workers = NULL;
+    io_active = NULL;
+    io_running = 0;
+}
+
+/*-------------------------------------------------------------*/
+/*Sets the number of worker threads running asynchronous       */
+/*requests, 0 runs them synchronously. Takes effect            */
+/*immediately if a disk is open.                               */
+/*-------------------------------------------------------------*/
+int set_io_threads(int num_threads)
+{
+    if (num_threads < 0)
+        return -1;
+
+    stop_io();
+    io_threads = num_threads;
+    if (fp != NULL)
+        start_io();
+    return 0;
+}
+
+/*-------------------------------------------------------------*/
+/*Sets how many requests can be submitted and not completed    */
+/*before submit_io waits for one to complete                   */
+/*-------------------------------------------------------------*/
+int set_io_depth(int depth)
+{
+    if (depth < 1)
+        return -1;
+
+    pthread_mutex_lock(&io_lock);
+    io_depth = depth;
+    pthread_mutex_unlock(&io_lock);
+    return 0;
+}
+
+/*-------------------------------------------------------------*/
+/*Submits a read or write of a series of blocks, to be run by  */
+/*a worker thread. The buffer must stay valid, and be left     */
+/*alone, until the request is completed (poll_io or wait_io).  */
+/*Requests may complete in any order, the caller waits for a   */
+/*write before reading the same blocks. Waits first if         */
+/*the queue depth is reached.                                  */
+/*-------------------------------------------------------------*/
+int submit_io(disk_request *req)
+{
+    req->done = 0;
+    req->next = NULL;
+
+    if (io_running == 0)
+    {
+        /*Synchronous fallback*/
+        run_request(req);
+        req->done = 1;
+        return 0;
+    }
+
+    pthread_mutex_lock(&io_lock);
+    while (io_pending >= io_depth)
+        pthread_cond_wait(&io_completed, &io_lock);
+    if (io_tail != NULL)
+        io_tail->next = req;
+    else
+        io_head = req;
+    io_tail = req;
+    io_pending++;
+    pthread_cond_signal(&io_submitted);
+    pthread_mutex_unlock(&io_lock);
+    return 0;
+}
+
+/*-----------------------------------------------------*/
+/*Returns 1 if a request is completed, 0 otherwise     */
+/*-----------------------------------------------------*/
+int poll_io(disk_request *req)
+{
+    int done;
+
+    pthread_mutex_lock(&io_lock);
+    done = req->done;
+    pthread_mutex_unlock(&io_lock);
+    return done;
+}
+
+/*------------------------------------------------------------*/
+/*Waits for a request to complete and returns its result      */
+/*------------------------------------------------------------*/
+int wait_io(disk_request *req)
+{
+    pthread_mutex_lock(&io_lock);
+    while (!req->done)
+        pthread_cond_wait(&io_completed, &io_lock);
+    pthread_mutex_unlock(&io_lock);
+    return req->result;
+}
+
+/*-----------------------------------------------------*/
+/*Waits for every submitted request to complete        */
+/*-----------------------------------------------------*/
+void drain_io()
+{
+    pthread_mutex_lock(&io_lock);
+    while (io_pending > 0)
+        pthread_cond_wait(&io_completed, &io_lock);
+    pthread_mutex_unlock(&io_lock);
+}
+
+/*------------------------------------------------------------*/
+/*Reads the blocks of a range missing from the cache into it, */
+/*run by a worker for prefetch_blocks                         */
+/*------------------------------------------------------------*/
+static void cache_prefetch(int start_address, int nblocks)
+{
+    int i, j, n;
+    unsigned long epoch;
+    cache_entry* c;
+    char* buf = malloc((size_t) nblocks * BLOCK_SIZE);
+
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < nblocks && cache_entries != NULL; i += n)
+    {
+        if (cache_lookup(start_address + i) != NULL)
+        {
+            n = 1;
+            continue;
+        }
+
+        /*Same as a miss in read_blocks, without a reader to hand the blocks to*/
+        for (n = 1; i + n < nblocks && cache_lookup(start_address + i + n) == NULL; n++)
+            ;
+        epoch = cache_epoch;
+        pthread_mutex_unlock(&cache_lock);
+        if (disk_read(start_address + i, n, buf) < 0)
+        {
+            pthread_mutex_lock(&cache_lock);
+            break;
+        }
+        pthread_mutex_lock(&cache_lock);
+        if (epoch != cache_epoch)
+            continue;
+        for (j = 0; j < n; j++)
+        {
+            if (cache_lookup(start_address + i + j) != NULL)
+                continue;
+            if ((c = cache_insert(start_address + i + j)) == NULL)
+                break;
+            memcpy(c->data, buf + (size_t) j * BLOCK_SIZE, BLOCK_SIZE);
+            c->prefetched = 1;
+            STAT_ADD(prefetched, 1);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    free(buf);
+}
+
+/*-------------------------------------------------------------*/
+/*Starts reading a range of blocks into the cache, so that a   */
+/*later read_blocks finds them there. Returns without waiting, */
+/*and does nothing without a cache or worker threads, or when  */
+/*the queue is full. At most a quarter of the cache is read at */
+/*once, so that blocks read ahead stay until they are used.    */
+/*Returns the number of blocks requested.                      */
+/*-------------------------------------------------------------*/
+int prefetch_blocks(int start_address, int nblocks)
+{
+    disk_request* req;
+
+    if (cache_entries == NULL || disk_map != NULL || io_running == 0 || nblocks <= 0)
+        return 0;
+    if (nblocks > cache_capacity / 4)
+        nblocks = cache_capacity / 4;
+    if (start_address < 0 || start_address + nblocks > MAX_BLOCK)
+        return 0;
+
+    pthread_mutex_lock(&io_lock);
+    if (io_pending >= io_depth)
+    {
+        /*Reads the caller waits for come first*/
+        pthread_mutex_unlock(&io_lock);
+        return 0;
+    }
+    req = (disk_request*) malloc(sizeof(disk_request));
+    if (req == NULL)
+    {
+        pthread_mutex_unlock(&io_lock);
+        return 0;
+    }
+    req->op = DISK_OP_PREFETCH;
+    req->start_address = start_address;
+    req->nblocks = nblocks;
+    req->buffer = NULL;
+    req->done = 0;
+    req->next = NULL;
+    if (io_tail != NULL)
+        io_tail->next = req;
+    else
+        io_head = req;
+    io_tail = req;
+    io_pending++;
+    pthread_cond_signal(&io_submitted);
+    pthread_mutex_unlock(&io_lock);
+    return nblocks;
+}
 
 /*----------------------------------------------------------*/
 /*Close the disk file filled when you don't need it anymore. */
@@ -18,7 +1312,12 @@ int close_disk()
 {
     if(NULL != fp)
     {
+        stop_io();
+        flush_disk();
+        cache_destroy();
+        unmap_disk();
         fclose(fp);
+        fp = NULL;
     }
     return 0;
 }
@@ -28,20 +1327,13 @@ int close_disk()
 /*---------------------------------------*/
 int init_fresh_disk(char *filename, int block_size, int num_blocks)
 {
-    int i, j;
-    
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
-    /*Set up failure at 10%*/
-    p = -1.f;
-    /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
+    int e;
+    off_t size;
 
     BLOCK_SIZE = block_size;
     MAX_BLOCK = num_blocks;
-    
-    /*Initializes the random number generator*/
-    srand((unsigned int)(time( 0 )) );
+    model_init();
+
     /*Creates a new file*/
     fp = fopen (filename, "w+b");
 
@@ -50,15 +1342,32 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
         printf("Could not create new disk file %s\n\n", filename);
         return -1;
     }
-    
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
+
+    /*Sizes the file, the new blocks read back as 0's. A sparse*/
+    /*file only gets storage as blocks are written, a          */
+    /*preallocated one reserves all of it up front             */
+    size = (off_t) MAX_BLOCK * BLOCK_SIZE;
+    if (image_type == DISK_IMAGE_PREALLOC)
+        e = posix_fallocate(fileno(fp), 0, size);
+    else
+        e = ftruncate(fileno(fp), size) < 0 ? errno : 0;
+
+    if (e != 0)
     {
-        for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            fputc(0, fp);
-        }
+        printf("Could not size new disk file %s: %s\n\n", filename, strerror(e));
+        fclose(fp);
+        fp = NULL;
+        return -1;
     }
+
+    if (backend == DISK_BACKEND_MMAP && map_disk() < 0)
+    {
+        fclose(fp);
+        fp = NULL;
+        return -1;
+    }
+    cache_create();
+    start_io();
     return 0;
 }
 /*----------------------------*/
@@ -66,19 +1375,10 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
 /*----------------------------*/
 int init_disk(char *filename, int block_size, int num_blocks)
 {
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
-    /*Set up failure at 10%*/
-    p = -1.f;
-    /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
-
     BLOCK_SIZE = block_size;
     MAX_BLOCK = num_blocks;
-    
-    /*Initializes the random number generator*/
-    srand((unsigned int)(time( 0 )) );
-    
+    model_init();
+
     /*Opens a file*/
     fp = fopen (filename, "r+b");
 
@@ -87,20 +1387,27 @@ int init_disk(char *filename, int block_size, int num_blocks)
         printf("Could not open %s\n\n", filename);
         return -1;
     }
+
+    if (backend == DISK_BACKEND_MMAP && map_disk() < 0)
+    {
+        fclose(fp);
+        fp = NULL;
+        return -1;
+    }
+    cache_create();
+    start_io();
     return 0;
 }
 
 /*-------------------------------------------------------------------*/
-/*Reads a series of blocks from the disk into the buffer             */
+/*Reads a series of blocks from the disk into the buffer. Safe to    */
+/*call from several threads, as is write_blocks.                     */
 /*-------------------------------------------------------------------*/
 int read_blocks(int start_address, int nblocks, void *buffer)
 {
-    int i, j, e, s;
-    e = 0;
-    s = 0;
-
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
+    int i, j, n, copied = 0;
+    unsigned long epoch;
+    cache_entry* c;
 
     /*Checks that the data requested is within the range of addresses of the disk*/
     if (start_address + nblocks > MAX_BLOCK)
@@ -108,45 +1415,91 @@ int read_blocks(int start_address, int nblocks, void *buffer)
         printf("out of bound error %d\n", start_address);
         return -1;
     }
+    /*Counted without the cache lock, the paths without a cache don't take it*/
+    STAT_ADD(blocks_read, nblocks);
 
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    if (disk_map != NULL)
+    {
+        /*The mapping stands for the device itself*/
+        if (model_request(start_address, nblocks) < 0)
+            return -1;
+        memcpy(buffer, disk_map + (size_t) start_address * BLOCK_SIZE, (size_t) nblocks * BLOCK_SIZE);
+        STAT_ADD(bytes_copied, (size_t) nblocks * BLOCK_SIZE);
+        return nblocks;
+    }
+    if (cache_entries == NULL)
+        return disk_read(start_address, nblocks, buffer);
 
     /*For every block requested*/
-    for (i = 0; i < nblocks; ++i)
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < nblocks; i += n)
     {
-        /*Pause until the latency duration is elapsed*/
-        // usleep(L);
+        c = cache_lookup(start_address + i);
+        if (c != NULL)
+        {
+            STAT_ADD(hits, 1);
+            if (c->prefetched)
+            {
+                STAT_ADD(prefetch_hits, 1);
+                c->prefetched = 0;
+            }
+            memcpy(buffer + (size_t) i * BLOCK_SIZE, c->data, BLOCK_SIZE);
+            copied++;
+            lru_unlink(c);
+            lru_push_front(c);
+            n = 1;
+            continue;
+        }
 
-        s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
+        /*Read the whole run of missing blocks at once, without holding*/
+        /*the lock, then cache it*/
+        for (n = 1; i + n < nblocks && cache_lookup(start_address + i + n) == NULL; n++)
+            ;
+        STAT_ADD(misses, n);
+        epoch = cache_epoch;
+        pthread_mutex_unlock(&cache_lock);
+        if (disk_read(start_address + i, n, buffer + (size_t) i * BLOCK_SIZE) < 0)
+            return -1;
+        pthread_mutex_lock(&cache_lock);
 
-       for (j = 0; j < BLOCK_SIZE; j++)
+        for (j = 0; j < n; j++)
         {
-            memcpy(buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
+            c = cache_lookup(start_address + i + j);
+            if (c != NULL)
+            {
+                /*Written or read by another thread meanwhile, the cached copy is as new*/
+                memcpy(buffer + (size_t) (i + j) * BLOCK_SIZE, c->data, BLOCK_SIZE);
+                copied++;
+                if (c->prefetched)
+                {
+                    STAT_ADD(prefetch_hits, 1);
+                    c->prefetched = 0;
+                }
+                continue;
+            }
+            /*Only cache what was read if no block was written meanwhile,*/
+            /*and if room can be made for it*/
+            if (epoch != cache_epoch || (c = cache_insert(start_address + i + j)) == NULL)
+                continue;
+            memcpy(c->data, buffer + (size_t) (i + j) * BLOCK_SIZE, BLOCK_SIZE);
+            copied++;
         }
     }
-
-    free(blockRead);
-
-
-    /*If no failure return the number of blocks read, else return the negative number of failures*/
-    if (e == 0)
-        return s;
-    else
-        return e;
+    pthread_mutex_unlock(&cache_lock);
+    STAT_ADD(bytes_copied, (size_t) copied * BLOCK_SIZE);
+    return nblocks;
 }
 
 /*------------------------------------------------------------------*/
-/*Writes a series of blocks to the disk from the buffer             */
+/*Writes a series of blocks to the disk from the buffer. A block the */
+/*cache has no room for, its dirty blocks failing to be written     */
+/*back, is written to the disk file directly instead. Returns -1 if */
+/*a block could be neither cached nor written.                      */
 /*------------------------------------------------------------------*/
 int write_blocks(int start_address, int nblocks, void *buffer)
 {
-    int i, e, s;
-    e = 0;
-    s = 0;
-
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
+    int i, res = nblocks;
+    cache_entry* c;
 
     /*Checks that the data requested is within the range of addresses of the disk*/
     if (start_address + nblocks > MAX_BLOCK)
@@ -154,27 +1507,50 @@ int write_blocks(int start_address, int nblocks, void *buffer)
         printf("out of bound error\n");
         return -1;
     }
+    STAT_ADD(blocks_written, nblocks);
 
-    /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    if (disk_map != NULL)
+    {
+        if (model_request(start_address, nblocks) < 0)
+            return -1;
+        memcpy(disk_map + (size_t) start_address * BLOCK_SIZE, buffer, (size_t) nblocks * BLOCK_SIZE);
+        STAT_ADD(bytes_copied, (size_t) nblocks * BLOCK_SIZE);
+        return nblocks;
+    }
+    if (cache_entries == NULL)
+        return disk_write(start_address, nblocks, buffer);
+    STAT_ADD(bytes_copied, (size_t) nblocks * BLOCK_SIZE);
 
-    /*For every block requested*/        
+    /*For every block requested*/
+    pthread_mutex_lock(&cache_lock);
+    cache_epoch++;
     for (i = 0; i < nblocks; ++i)
     {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
-
-        memcpy(blockWrite, buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
-
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
-        s++;
+        c = cache_lookup(start_address + i);
+        if (c == NULL)
+        {
+            STAT_ADD(misses, 1);
+            if ((c = cache_insert(start_address + i)) == NULL)
+            {
+                if (disk_write(start_address + i, 1, buffer + (size_t) i * BLOCK_SIZE) < 0)
+                    res = -1;
+                continue;
+            }
+        }
+        else
+        {
+            STAT_ADD(hits, 1);
+            if (c->prefetched)
+            {
+                STAT_ADD(prefetch_wasted, 1);
+                c->prefetched = 0;
+            }
+            lru_unlink(c);
+            lru_push_front(c);
+        }
+        memcpy(c->data, buffer + (size_t) i * BLOCK_SIZE, BLOCK_SIZE);
+        c->dirty = 1;
     }
-    free(blockWrite);
-
-    /*If no failure return the number of blocks written, else return the negative number of failures*/
-    if (e == 0)
-        return s;
-    else
-        return e;
+    pthread_mutex_unlock(&cache_lock);
+    return res;
 }
@@ -1,5 +1,90 @@
+#ifndef _INCLUDE_DISK_EMU_H_
+#define _INCLUDE_DISK_EMU_H_
+
+/*Ways of moving blocks to and from the disk file, see set_disk_backend*/
+#define DISK_BACKEND_STDIO 0    /*fseek, one fread per range and one fwrite per block*/
+#define DISK_BACKEND_PIO 1      /*one pread/pwrite(v) per range, thread-safe*/
+#define DISK_BACKEND_MMAP 2     /*whole file mapped, blocks copied with memcpy*/
+
+/*How init_fresh_disk creates the disk file, see set_disk_image_type*/
+#define DISK_IMAGE_SPARSE 0     /*ftruncate, storage allocated on first write*/
+#define DISK_IMAGE_PREALLOC 1   /*fallocate, all storage reserved up front*/
+
+/*Number of blocks kept in the block cache unless set_cache_size is called*/
+#define DEFAULT_CACHE_BLOCKS 1024
+
+/*Asynchronous requests, see submit_io*/
+#define DISK_OP_READ 0
+#define DISK_OP_WRITE 1
+#define DISK_OP_PREFETCH 2      /*internal, see prefetch_blocks*/
+#define DEFAULT_IO_THREADS 4    /*workers running requests, 0 runs them synchronously*/
+#define DEFAULT_IO_DEPTH 32     /*requests submitted and not completed before submit_io waits*/
+
+typedef struct disk_request {
+    int op;                     /*DISK_OP_READ or DISK_OP_WRITE*/
+    int start_address;
+    int nblocks;
+    void *buffer;
+    int result;                 /*what read_blocks or write_blocks returned, once done*/
+    int done;                   /*private, 1 once completed*/
+    struct disk_request *next;  /*private, submission queue*/
+} disk_request;
+
+typedef struct {
+    unsigned long hits;         /*block accesses served by the cache*/
+    unsigned long misses;       /*block accesses that went to the disk file*/
+    unsigned long evictions;    /*blocks dropped to make room for others*/
+    unsigned long writebacks;   /*dirty blocks written to the disk file*/
+    unsigned long prefetched;   /*blocks read into the cache by prefetch_blocks*/
+    unsigned long prefetch_hits;    /*prefetched blocks later read*/
+    unsigned long prefetch_wasted;  /*prefetched blocks dropped or overwritten before being read*/
+    unsigned long blocks_read;      /*blocks asked for through read_blocks, with or without a cache*/
+    unsigned long blocks_written;   /*blocks handed to write_blocks, with or without a cache*/
+    unsigned long syscalls;         /*reads, writes, seeks and flushes made on the disk file*/
+    unsigned long bytes_copied;     /*bytes copied between the callers' buffers and the cache or mapping*/
+    unsigned long device_ns;        /*time the device model charged for the requests, see set_disk_model*/
+    unsigned long device_retries;   /*attempts the device model failed and retried*/
+    unsigned long device_errors;    /*requests failed after every retry*/
+} cache_stats_t;
+
+/*Cost of the device behind the disk file, see set_disk_model. All*/
+/*0 (the default) makes every request free.                       */
+typedef struct {
+    unsigned long request_ns;   /*fixed cost of every request*/
+    unsigned long seek_ns;      /*cost of a seek across the whole disk, shorter ones cost in proportion*/
+    unsigned long rotate_ns;    /*added to every request not starting where the previous one ended*/
+    unsigned long bandwidth;    /*transfer rate in bytes per second, 0 for free transfers*/
+    double fail_rate;           /*probability for an attempt to fail transiently*/
+    int max_retries;            /*attempts after a failed one before the request fails*/
+    int sleep;                  /*1 to make the callers wait for the time charged*/
+    unsigned long seed;         /*of the failure draws*/
+} disk_model_t;
+
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
+void* get_block_ptr(int address);
+int get_disk_fd();
+int sync_blocks(int start_address, int nblocks);
+int invalidate_blocks(int start_address, int nblocks);
+int flush_disk();
 int close_disk();
+int set_disk_backend(int type);
+int set_disk_image_type(int type);
+int set_cache_size(int num_blocks);
+int get_cache_size();
+int set_io_threads(int num_threads);
+int set_io_depth(int depth);
+int submit_io(disk_request *req);
+int poll_io(disk_request *req);
+int wait_io(disk_request *req);
+void drain_io();
+int prefetch_blocks(int start_address, int nblocks);
+int set_disk_model(const disk_model_t *model);
+void get_disk_model(disk_model_t *model);
+int parse_disk_model(const char *spec, disk_model_t *model);
+void get_cache_stats(cache_stats_t* stats);
+void reset_cache_stats();
+
+#endif //_INCLUDE_DISK_EMU_H_
@@ -10,42 +10,232 @@
 #include <dirent.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <linux/falloc.h>
 #include "disk_emu.h"
 #include "sfs_api.h"
 
+// largest read and write requested from the kernel, its limit without
+// raising max_pages
+#define FUSE_MAX_IO (128 * 1024)
+
+// mount options of our own, see main
+struct sfs_options {
+    int reopen;         // mount the existing disk image instead of formatting it
+    char *disk_model;   // the cost of the device, see parse_disk_model
+    int defrag_idle;    // seconds without a call before the files are defragmented, 0 never
+};
+
+static const struct fuse_opt sfs_opts[] = {
+    { "reopen", offsetof(struct sfs_options, reopen), 1 },
+    { "disk_model=%s", offsetof(struct sfs_options, disk_model), 0 },
+    { "defrag_idle=%d", offsetof(struct sfs_options, defrag_idle), 0 },
+    FUSE_OPT_END
+};
+
+// the files are defragmented in the background once the file system has
+// been idle for defrag_idle seconds, stopping as soon as a call comes in
+static int defrag_idle = 0;
+static int defrag_stop = 0;
+static pthread_t defrag_thread;
+static pthread_mutex_t defrag_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t defrag_wakeup = PTHREAD_COND_INITIALIZER;
+
+// the activity counters of every layer, as a virtual file that isn't on
+// the disk image. Its text is rendered when it is opened, so reading it
+// is the only time they cost more than an atomic add, and writing to it
+// or truncating it resets them
+#define STATS_PATH "/.sfs_stats"
+#define STATS_MAX (8 * 1024)
+
+struct fuse_stats {
+    size_t len;
+    char text[STATS_MAX];
+};
+
+/**
+ * @return whether a path is the counters file
+ */
+static int fuse_isstats(const char *path)
+{
+    return path != NULL && strcmp(path, STATS_PATH) == 0;
+}
+
+/**
+ * Renders the counters as one "name value" line each
+ *
+ * @return the length of the text, at most size
+ */
+static size_t fuse_formatstats(char *buf, size_t size)
+{
+    static const char *op_names[SFS_NUM_OPS] = {
+        [SFS_OP_OPEN] = "open",
+        [SFS_OP_CLOSE] = "close",
+        [SFS_OP_READ] = "read",
+        [SFS_OP_WRITE] = "write",
+        [SFS_OP_STAT] = "stat",
+        [SFS_OP_READDIR] = "readdir",
+        [SFS_OP_REMOVE] = "remove",
+        [SFS_OP_TRUNCATE] = "truncate",
+        [SFS_OP_FALLOCATE] = "fallocate",
+        [SFS_OP_FLUSH] = "flush",
+        [SFS_OP_SYNC] = "sync",
+    };
+    sfs_stats_t st;
+    alloc_stats_t as;
+    journal_stats_t js;
+    cache_stats_t cs;
+    size_t len = 0;
+    
+    sfs_getstats(&st);
+    get_alloc_stats(&as);
+    get_journal_stats(&js);
+    get_cache_stats(&cs);
+    
+#define STAT_LINE(_name, _value) \
+    len += snprintf(buf + len, len < size ? size - len : 0, "%s %lu\n", _name, (unsigned long) (_value))
+#define STAT_OP(_op, _what, _value) \
+    len += snprintf(buf + len, len < size ? size - len : 0, "op.%s.%s %lu\n", op_names[_op], _what, (unsigned long) (_value))
+    
+    for (int op = 0; op < SFS_NUM_OPS; ++op) {
+        STAT_OP(op, "count", st.op_count[op]);
+        STAT_OP(op, "ns", st.op_ns[op]);
+    }
+    STAT_LINE("sfs.bytes_read", st.bytes_read);
+    STAT_LINE("sfs.bytes_written", st.bytes_written);
+    STAT_LINE("sfs.bytes_copied", st.bytes_copied);
+    STAT_LINE("sfs.lookups", st.lookups);
+    STAT_LINE("sfs.lookup_probes", st.lookup_probes);
+    STAT_LINE("sfs.metadata_flushes", st.metadata_flushes);
+    STAT_LINE("sfs.buffered_writes", st.buffered_writes);
+    STAT_LINE("sfs.buffer_flushes", st.buffer_flushes);
+    STAT_LINE("alloc.allocations", as.allocations);
+    STAT_LINE("alloc.blocks", as.blocks);
+    STAT_LINE("alloc.scans", as.scans);
+    STAT_LINE("alloc.runs", as.runs);
+    STAT_LINE("journal.commits", js.commits);
+    STAT_LINE("journal.blocks", js.blocks);
+    STAT_LINE("journal.journal_writes", js.journal_writes);
+    STAT_LINE("journal.checkpoints", js.checkpoints);
+    STAT_LINE("journal.overflows", js.overflows);
+    STAT_LINE("disk.blocks_read", cs.blocks_read);
+    STAT_LINE("disk.blocks_written", cs.blocks_written);
+    STAT_LINE("disk.syscalls", cs.syscalls);
+    STAT_LINE("disk.bytes_copied", cs.bytes_copied);
+    STAT_LINE("disk.device_ns", cs.device_ns);
+    STAT_LINE("disk.device_retries", cs.device_retries);
+    STAT_LINE("disk.device_errors", cs.device_errors);
+    STAT_LINE("cache.hits", cs.hits);
+    STAT_LINE("cache.misses", cs.misses);
+    STAT_LINE("cache.evictions", cs.evictions);
+    STAT_LINE("cache.writebacks", cs.writebacks);
+    STAT_LINE("cache.prefetched", cs.prefetched);
+    STAT_LINE("cache.prefetch_hits", cs.prefetch_hits);
+    STAT_LINE("cache.prefetch_wasted", cs.prefetch_wasted);
+    
+#undef STAT_LINE
+#undef STAT_OP
+    return len < size ? len : size;
+}
+
+/**
+ * Opens the counters file, keeping a copy of its text in fi->fh
+ */
+static int fuse_openstats(struct fuse_file_info *fi)
+{
+    struct fuse_stats *stats = malloc(sizeof(struct fuse_stats));
+    
+    if (stats == NULL)
+        return -ENOMEM;
+    stats->len = fuse_formatstats(stats->text, STATS_MAX);
+    fi->fh = (uintptr_t) stats;
+    // the size of the text isn't known to getattr, reads go by the text itself
+    fi->direct_io = 1;
+    return 0;
+}
+
+/**
+ * Reads the text of an open counters file
+ *
+ * @return the number of bytes read
+ */
+static int fuse_readstats(struct fuse_file_info *fi, char *buf, size_t size, off_t offset)
+{
+    struct fuse_stats *stats = (struct fuse_stats *) (uintptr_t) fi->fh;
+    
+    if (offset < 0 || (size_t) offset >= stats->len)
+        return 0;
+    if (size > stats->len - offset)
+        size = stats->len - offset;
+    memcpy(buf, stats->text + offset, size);
+    return size;
+}
+
+/**
+ * Fills the attributes of a regular file
+ */
+static void fuse_fillstat(const sfs_stat_t *st, struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = st->inode;
+    stbuf->st_mode = S_IFREG | 0666;
+    stbuf->st_nlink = 1;
+    stbuf->st_size = st->size;
+    stbuf->st_blksize = st->block_size;
+    stbuf->st_blocks = (st->size + st->block_size - 1) / st->block_size * (st->block_size / 512);
+}
+
 static int fuse_getattr(const char *path, struct stat *stbuf)
 {
     int res = 0;
-    int size;
+    sfs_stat_t st;
     
     memset(stbuf, 0, sizeof(struct stat));
     
     if (strcmp(path, "/") == 0) {
         stbuf->st_mode = S_IFDIR | 0755;
         stbuf->st_nlink = 2;
-    } else if((size = sfs_getfilesize(path)) != -1) {
-        stbuf->st_mode = S_IFREG | 0666;
+    } else if (fuse_isstats(path)) {
+        stbuf->st_mode = S_IFREG | 0644;
         stbuf->st_nlink = 1;
-        stbuf->st_size = size;
-    } else
+    } else if (sfs_stat(path, &st) == 0)
+        fuse_fillstat(&st, stbuf);
+    else
         res = -ENOENT;
     
     return res;
 }
 
+/**
+ * Lists the root directory in one pass, with the attributes of every
+ * file. The offset of an entry is its position in the root directory
+ * plus 2, after ".", ".." and the counters file, so a listing too large
+ * for one reply resumes where the previous one stopped.
+ */
 static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         off_t offset, struct fuse_file_info *fi)
 {
     char file_name[MAXFILENAME];
+    struct stat stbuf;
+    sfs_stat_t st;
+    uint32_t pos = offset > 2 ? offset - 2 : 0;
     
     if (strcmp(path, "/") != 0)
         return -ENOENT;
     
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+    if (offset < 1 && filler(buf, ".", NULL, 1))
+        return 0;
+    if (offset < 2 && filler(buf, "..", NULL, 2))
+        return 0;
+    if (offset < 3 && filler(buf, &STATS_PATH[1], NULL, 3))
+        return 0;
     
-    while(sfs_getnextfilename(file_name)) {
-        filler(buf, &file_name[1], NULL, 0);
+    while (sfs_getnextentry(&pos, file_name, &st)) {
+        fuse_fillstat(&st, &stbuf);
+        if (filler(buf, &file_name[1], &stbuf, pos + 2))
+            break;
     }
     
     return 0;
@@ -56,26 +246,91 @@ static int fuse_unlink(const char *path)
     int res;
     char filename[MAXFILENAME];
     
+    if (fuse_isstats(path))
+        return -EPERM;
     strcpy(filename, path);
+    // SFS doesn't set errno, its only failure is a file not found
     res = sfs_remove(filename);
     if (res == -1)
-        return -errno;
+        return -ENOENT;
+    if (res < 0)
+        return -EIO;
     
     return 0;
 }
 
+/**
+ * Keeps an open SFS file in fi->fh, with the generation of its file
+ * descriptor table entry so that a handle to a removed file can't
+ * reach a file created in the same entry afterwards
+ */
+static void fuse_sethandle(struct fuse_file_info *fi, int fd)
+{
+    fi->fh = (uint64_t) sfs_fgen(fd) << 32 | (uint32_t) fd;
+}
+
+/**
+ * @return the SFS file of a handle, -EBADF if it was removed
+ */
+static int fuse_gethandle(struct fuse_file_info *fi)
+{
+    int fd = (int) (uint32_t) fi->fh;
+    
+    if (sfs_fgen(fd) != (uint32_t) (fi->fh >> 32))
+        return -EBADF;
+    return fd;
+}
+
+/**
+ * @return the error number for the result of an SFS call changing the size of a file
+ */
+static int fuse_sizeerror(int res)
+{
+    if (res >= 0)
+        return 0;
+    if (res == -4)
+        return -EFBIG;
+    if (res == -5)
+        return -ENOSPC;
+    return -EIO;
+}
+
+/**
+ * @return the error number for the result of an SFS call opening a file
+ */
+static int fuse_openerror(int res)
+{
+    if (res >= 0)
+        return 0;
+    if (res == -1)
+        return -ENAMETOOLONG;
+    if (res == -2)
+        return -EBUSY;
+    if (res == -3)
+        return -ENFILE;
+    if (res == -4)
+        return -ENOSPC;
+    return -EIO;
+}
+
 static int fuse_open(const char *path, struct fuse_file_info *fi)
 {
-    int res;
+    int fd;
     char filename[MAXFILENAME];
     
+    if (fuse_isstats(path))
+        return fuse_openstats(fi);
+    if (strlen(path) >= MAXFILENAME)
+        return -ENAMETOOLONG;
     strcpy(filename, path);
     
-    res = sfs_fopen(filename);
-    if (res == -1)
-        return -errno;
+    // the file stays open until release, every handle to it sharing
+    // the same entry of the file descriptor table
+    fd = sfs_fopenshared(filename);
+    if (fd < 0)
+        return fuse_openerror(fd);
     
-    sfs_fclose(res);
+    fuse_sethandle(fi, fd);
     return 0;
 }
 
@@ -85,64 +340,272 @@ static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
     int fd;
     int res;
     
-    char filename[MAXFILENAME];
+    if (fuse_isstats(path))
+        return fuse_readstats(fi, buf, size, offset);
+    if ((fd = fuse_gethandle(fi)) < 0)
+        return fd;
     
-    strcpy(filename, path);
+    res = sfs_pread(fd, buf, size, offset);
+    if (res < 0)
+        return -EIO;
     
-    fd = sfs_fopen(filename);
-    if (fd == -1)
-        return -errno;
+    return res;
+}
+
+static int fuse_write(const char *path, const char *buf, size_t size,
+        off_t offset, struct fuse_file_info *fi)
+{
+    int fd;
+    int res;
     
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
+    if (fuse_isstats(path)) {
+        // whatever is written, it resets the counters
+        sfs_resetstats();
+        return size;
+    }
+    if ((fd = fuse_gethandle(fi)) < 0)
+        return fd;
     
-    res = sfs_fread(fd, buf, size);
-    if (res == -1)
-        return -errno;
+    res = sfs_pwrite(fd, buf, size, offset);
+    if (res < 0)
+        return fuse_sizeerror(res);
+    if (res == 0 && size > 0)
+        return -ENOSPC;
     
-    sfs_fclose(fd);
     return res;
 }
 
-static int fuse_write(const char *path, const char *buf, size_t size,
+/**
+ * Copies an extent of a file into the buffer of a read, from the mapping
+ * of the disk file or from the disk file. It is copied while SFS holds the
+ * lock of the file: once it is dropped a truncate, a remove or the
+ * defragmenter can reuse the blocks, so fuse can't splice them later.
+ */
+static int fuse_copyout(void *arg, const sfs_extent_t *extent)
+{
+    struct fuse_buf *buf = arg;
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(extent->length);
+    struct fuse_bufvec src = FUSE_BUFVEC_INIT(extent->length);
+    ssize_t res;
+    
+    dst.buf[0].mem = (char *) buf->mem + buf->size;
+    if (extent->mem != NULL) {
+        src.buf[0].mem = extent->mem;
+    } else {
+        src.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+        src.buf[0].fd = get_disk_fd();
+        src.buf[0].pos = extent->pos;
+    }
+    
+    res = fuse_buf_copy(&dst, &src, 0);
+    if (res < 0)
+        return 0;
+    buf->size += res;
+    return res;
+}
+
+static int fuse_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
         off_t offset, struct fuse_file_info *fi)
 {
     int fd;
     int res;
+    struct fuse_bufvec *v;
     
-    char filename[MAXFILENAME];
+    if (!fuse_isstats(path) && (fd = fuse_gethandle(fi)) < 0)
+        return fd;
     
-    strcpy(filename, path);
+    v = malloc(sizeof(struct fuse_bufvec));
+    if (v == NULL)
+        return -ENOMEM;
+    *v = FUSE_BUFVEC_INIT(0);
+    v->buf[0].mem = malloc(size);
+    if (v->buf[0].mem == NULL) {
+        free(v);
+        return -ENOMEM;
+    }
+    *bufp = v;
     
-    fd = sfs_fopen(filename);
-    if (fd == -1) 
-        return -errno;
+    if (fuse_isstats(path)) {
+        v->buf[0].size = fuse_readstats(fi, v->buf[0].mem, size, offset);
+        return 0;
+    } else if (get_disk_fd() < 0) {
+        // the disk file can't be read directly, go through the block cache
+        res = sfs_pread(fd, v->buf[0].mem, size, offset);
+        v->buf[0].size = res > 0 ? res : 0;
+    } else {
+        // copy the extents of the file straight from the disk file,
+        // without filling the block cache with them
+        res = sfs_preadextents(fd, size, offset, fuse_copyout, &v->buf[0]);
+    }
     
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
+    if (res < 0)
+        return -EIO;
+    return 0;
+}
+
+/**
+ * Writes an extent of a file with the next bytes of a write request,
+ * straight into the mapping of the disk file or into the disk file
+ */
+static int fuse_copyextent(void *arg, const sfs_extent_t *extent)
+{
+    struct fuse_bufvec *src = arg;
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(extent->length);
+    ssize_t res;
     
-    res = sfs_fwrite(fd, buf, size);
-    if (res == -1)
-        return -errno;
+    if (extent->mem != NULL) {
+        dst.buf[0].mem = extent->mem;
+    } else {
+        dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+        dst.buf[0].fd = get_disk_fd();
+        dst.buf[0].pos = extent->pos;
+    }
     
-    sfs_fclose(fd);
+    res = fuse_buf_copy(&dst, src, 0);
+    return res < 0 ? 0 : res;
+}
+
+static int fuse_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+        struct fuse_file_info *fi)
+{
+    int fd;
+    int res;
+    size_t size = fuse_buf_size(buf);
+    
+    if (fuse_isstats(path)) {
+        sfs_resetstats();
+        return size;
+    }
+    if ((fd = fuse_gethandle(fi)) < 0)
+        return fd;
+    
+    if (get_disk_fd() >= 0 && size >= FUSE_MAX_IO)
+        // fuse_buf_copy moves the data into the blocks as they are allocated,
+        // smaller writes are copied so that sfs_pwrite can buffer them
+        res = sfs_pwriteextents(fd, size, offset, fuse_copyextent, buf);
+    else if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD))
+        res = sfs_pwrite(fd, buf->buf[0].mem, size, offset);
+    else {
+        // the request came in a pipe, bring it into memory first
+        struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+        
+        if ((mem.buf[0].mem = malloc(size)) == NULL)
+            return -ENOMEM;
+        res = fuse_buf_copy(&mem, buf, 0);
+        if (res >= 0)
+            res = sfs_pwrite(fd, mem.buf[0].mem, res, offset);
+        free(mem.buf[0].mem);
+    }
+    
+    if (res < 0)
+        return fuse_sizeerror(res);
+    if (res == 0 && size > 0)
+        return -ENOSPC;
     return res;
 }
 
+static int fuse_release(const char *path, struct fuse_file_info *fi)
+{
+    int fd;
+    
+    if (fuse_isstats(path)) {
+        free((struct fuse_stats *) (uintptr_t) fi->fh);
+        return 0;
+    }
+    // the file may have been removed while open, then there's nothing to close
+    if ((fd = fuse_gethandle(fi)) >= 0)
+        sfs_fclose(fd);
+    return 0;
+}
+
+static int fuse_flush(const char *path, struct fuse_file_info *fi)
+{
+    int fd;
+    
+    // called on every close of the handle, the buffered writes
+    // of the file get their blocks and go to the block layer
+    if (fuse_isstats(path))
+        return 0;
+    if ((fd = fuse_gethandle(fi)) < 0)
+        return fd;
+    return fuse_sizeerror(sfs_fflush(fd));
+}
+
+static int fuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    int fd;
+    
+    if (fuse_isstats(path))
+        return 0;
+    if ((fd = fuse_gethandle(fi)) < 0)
+        return fd;
+    
+    // the journal is shared by all files, committing it and writing
+    // back the block cache makes this one durable too
+    return fuse_sizeerror(sfs_sync());
+}
+
+static int fuse_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    int fd;
+    
+    if (fuse_isstats(path)) {
+        sfs_resetstats();
+        return 0;
+    }
+    if ((fd = fuse_gethandle(fi)) < 0)
+        return fd;
+    if (size < 0)
+        return -EINVAL;
+    return fuse_sizeerror(sfs_ftruncate(fd, size));
+}
+
 static int fuse_truncate(const char *path, off_t size)
 {
     char filename[MAXFILENAME];
     int fd;
+    int res;
     
+    if (fuse_isstats(path)) {
+        sfs_resetstats();
+        return 0;
+    }
+    if (strlen(path) >= MAXFILENAME || sfs_getfilesize(path) == -1)
+        return -ENOENT;
+    if (size < 0)
+        return -EINVAL;
     strcpy(filename, path);
     
-    fd = sfs_remove(filename);
-    if (fd == -1)
-        return -errno;
-    
-    fd = sfs_fopen(filename);
+    fd = sfs_fopenshared(filename);
+    if (fd < 0)
+        return fuse_openerror(fd);
+    res = sfs_ftruncate(fd, size);
     sfs_fclose(fd);
-    return 0;
+    return fuse_sizeerror(res);
+}
+
+static int fuse_fallocate(const char *path, int mode, off_t offset, off_t length,
+        struct fuse_file_info *fi)
+{
+    int fd;
+    int res;
+    
+    if (fuse_isstats(path))
+        return -EOPNOTSUPP;
+    if ((fd = fuse_gethandle(fi)) < 0)
+        return fd;
+    // sfs_fallocate allocates the holes and the blocks past the end of
+    // the file, punching holes and zeroing ranges aren't supported
+    if (mode & ~FALLOC_FL_KEEP_SIZE)
+        return -EOPNOTSUPP;
+    if (offset < 0 || length <= 0)
+        return -EINVAL;
+    
+    res = sfs_fallocate(fd, offset + length);
+    if (res == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && offset + length > sfs_getfilesize(path))
+        // the new part reads back as zeros, the truncate clears the blocks just allocated for it
+        res = sfs_ftruncate(fd, offset + length);
+    return fuse_sizeerror(res);
 }
 
 static int fuse_access(const char *path, int mask)
@@ -157,14 +620,99 @@ static int fuse_mknod(const char *path, mode_t mode, dev_t rdev)
 
 static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fp)
 {
-    char filename[MAXFILENAME];
-    int fd;
-    
-    strcpy(filename, path);
-    fd = sfs_fopen(filename);
-    
-    sfs_fclose(fd);
-    return 0;
+    return fuse_open(path, fp);
+}
+
+/**
+ * @return the number of file system calls so far, see sfs_getstats
+ */
+static unsigned long fuse_opcount(void)
+{
+    sfs_stats_t stats;
+    unsigned long count = 0;
+
+    sfs_getstats(&stats);
+    for (int op = 0; op < SFS_NUM_OPS; ++op)
+        count += stats.op_count[op];
+    return count;
+}
+
+/**
+ * Stops a background defragmentation when a call came in since it started
+ *
+ * @param  arg the number of calls when it started
+ * @return     whether to stop
+ */
+static int fuse_defragbusy(void *arg)
+{
+    return __atomic_load_n(&defrag_stop, __ATOMIC_RELAXED) || fuse_opcount() != *(unsigned long *) arg;
+}
+
+static void *fuse_defragthread(void *arg)
+{
+    unsigned long last = fuse_opcount();
+    int done = 0;       // a pass found nothing to move since the last call
+
+    pthread_mutex_lock(&defrag_lock);
+    while (!defrag_stop) {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += defrag_idle;
+        pthread_cond_timedwait(&defrag_wakeup, &defrag_lock, &wake);
+        if (defrag_stop)
+            break;
+
+        unsigned long ops = fuse_opcount();
+        if (ops != last) {
+            last = ops;
+            done = 0;
+            continue;
+        }
+        if (done)
+            continue;
+
+        pthread_mutex_unlock(&defrag_lock);
+        done = sfs_defragall(1, fuse_defragbusy, &last) == 0;
+        pthread_mutex_lock(&defrag_lock);
+    }
+    pthread_mutex_unlock(&defrag_lock);
+    return NULL;
+}
+
+static void *fuse_init(struct fuse_conn_info *conn)
+{
+    // let the kernel move the data of writes through a pipe, see write_buf,
+    // the replies to reads are copied while the file is locked, see read_buf
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_BIG_WRITES);
+    if (conn->max_write < FUSE_MAX_IO)
+        conn->max_write = FUSE_MAX_IO;
+
+    // mounted here rather than in main, fuse_main forks when it daemonizes
+    // and the child has none of the threads started before: the journal
+    // thread, the I/O workers and the defragmenter
+    if (sfs_reopen() != 0) {
+        fprintf(stderr, "sfs: can't mount the disk image\n");
+        defrag_idle = 0;
+        fuse_exit(fuse_get_context()->fuse);
+        return NULL;
+    }
+    if (defrag_idle > 0 && pthread_create(&defrag_thread, NULL, fuse_defragthread, NULL) != 0)
+        defrag_idle = 0;
+    return NULL;
+}
+
+static void fuse_destroy(void *private_data)
+{
+    if (defrag_idle > 0) {
+        pthread_mutex_lock(&defrag_lock);
+        __atomic_store_n(&defrag_stop, 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&defrag_wakeup);
+        pthread_mutex_unlock(&defrag_lock);
+        pthread_join(defrag_thread, NULL);
+    }
+
+    // commit the pending metadata changes and write back the block cache
+    sfs_unmount();
 }
 
 static struct fuse_operations xmp_oper = {
@@ -173,16 +721,68 @@ static struct fuse_operations xmp_oper = {
     .mknod = fuse_mknod,
     .unlink = fuse_unlink,
     .truncate = fuse_truncate,
+    .ftruncate = fuse_ftruncate,
+    .fallocate = fuse_fallocate,
     .open = fuse_open, 
     .read = fuse_read, 
     .write = fuse_write, 
+    .read_buf = fuse_read_buf,
+    .write_buf = fuse_write_buf,
+    .flush = fuse_flush,
+    .release = fuse_release,
+    .fsync = fuse_fsync,
     .access = fuse_access,
     .create = fuse_create,
+    .init = fuse_init,
+    .destroy = fuse_destroy,
 };
 
 int main(int argc, char *argv[])
 {
-    mksfs(1);
+    int res;
+    char io_opts[64];
+    disk_model_t model;
+    struct sfs_options opts = { 0 };
+    struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+    
+    // ask for large requests, before the user's options so they can override it
+    snprintf(io_opts, sizeof(io_opts), "-obig_writes,max_read=%d,max_write=%d", FUSE_MAX_IO, FUSE_MAX_IO);
+    fuse_opt_add_arg(&args, argv[0]);
+    fuse_opt_add_arg(&args, io_opts);
+    for (int i = 1; i < argc; ++i)
+        fuse_opt_add_arg(&args, argv[i]);
+    
+    // -o reopen keeps the files of the last mount, the disk is formatted otherwise
+    if (fuse_opt_parse(&args, &opts, sfs_opts, NULL) == -1)
+        return 1;
     
-    return fuse_main(argc, argv, &xmp_oper, NULL);
+    // -o disk_model=hdd:fail_rate=0.001 charges the requests on the disk image
+    // as that device would, overriding SFS_DISK_MODEL (':' separates the
+    // items since ',' separates the options)
+    if (opts.disk_model != NULL) {
+        if (parse_disk_model(opts.disk_model, &model) != 0 || set_disk_model(&model) != 0) {
+            fprintf(stderr, "%s: bad disk model %s\n", argv[0], opts.disk_model);
+            fuse_opt_free_args(&args);
+            return 1;
+        }
+    }
+    // -o defrag_idle=30 defragments the files after 30 seconds without a call
+    defrag_idle = opts.defrag_idle > 0 ? opts.defrag_idle : 0;
+
+    // formatted or checked here so that a bad image fails before the mount,
+    // then unmounted again, fuse_init mounts it in the process that serves it
+    if (!opts.reopen)
+        mksfs(1);
+    else if (sfs_reopen() != 0) {
+        fprintf(stderr, "%s: no valid disk image to reopen\n", argv[0]);
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+    sfs_unmount();
+    
+    // the file system calls are thread-safe, so fuse runs its
+    // multithreaded loop unless -s is given
+    res = fuse_main(args.argc, args.argv, &xmp_oper, NULL);
+    fuse_opt_free_args(&args);
+    return res;
 }
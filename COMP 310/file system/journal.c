@@ -0,0 +1,665 @@
+#include "sfs_api.h"
+#include "disk_emu.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/* on-disk format
+ *
+ * block 0 of the journal is the journal header, holding the sequence
+ * number of the first transaction to replay. Transactions follow it
+ * back to back, each one being
+ *
+ *   descriptor, the blocks it describes, [descriptor, blocks, ...] commit
+ *
+ * A descriptor lists the home location of each block that follows it, and
+ * the blocks freed by the transaction (revoked), which must not be replayed
+ * from older transactions. The commit block holds a checksum of the whole
+ * transaction, so a transaction cut short by a crash is not replayed.
+ * A checkpoint makes every committed block durable at its home location
+ * and empties the journal by moving the header past the last transaction.
+ */
+#define JOURNAL_MAGIC 0x4A524E4C
+#define JOURNAL_HEADER 1
+#define JOURNAL_DESCRIPTOR 2
+#define JOURNAL_COMMIT 3
+
+#define JOURNAL_TAG_REVOKE 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t seq;       // the transaction this block belongs to
+} journal_block_t;
+
+typedef struct {
+    uint32_t block;     // home location of the block
+    uint32_t flags;
+} journal_tag_t;
+
+typedef struct {
+    journal_block_t h;
+    uint32_t count;     // number of tags
+    uint32_t reserved;
+    journal_tag_t tags[];
+} journal_descriptor_t;
+
+typedef struct {
+    journal_block_t h;
+    uint32_t nblocks;   // length of the transaction, commit block excluded
+    uint32_t checksum;  // of the nblocks blocks before the commit block
+} journal_commit_t;
+
+#define TAGS_PER_DESCRIPTOR ((journal_block_size - sizeof(journal_descriptor_t)) / sizeof(journal_tag_t))
+
+// where the journal is
+uint32_t journal_start = 0;
+uint32_t journal_nblocks = 0;
+uint32_t journal_block_size = 0;
+
+uint32_t journal_next = 1;          // the journal block the next transaction is written to
+uint64_t journal_seq = 1;           // the sequence number of the running transaction
+
+// a hash of block numbers, so that finding a block in the running
+// transaction doesn't take a pass over all of it
+typedef struct {
+    uint32_t* keys;     // the block + 1, 0 for an empty slot
+    uint32_t* values;   // its position in the transaction
+    uint32_t mask;      // the number of slots - 1, a power of two
+    uint32_t count;
+} block_index_t;
+
+#define INDEX_EMPTY UINT32_MAX
+
+// the running transaction, the blocks it will write and their home location
+uint32_t* txn_blocks = NULL;
+char* txn_data = NULL;
+uint32_t txn_count = 0;
+uint32_t txn_capacity = 0;
+block_index_t txn_index;            // the position of each block in txn_blocks
+struct timespec txn_started;        // when the first block was added
+
+// blocks freed by the running transaction, they are handed back to the
+// free bit map when it commits so they can't be overwritten before that
+uint32_t* txn_frees = NULL;
+uint8_t* txn_revoked = NULL;        // whether each freed block held metadata
+uint32_t txn_free_count = 0;
+uint32_t txn_free_capacity = 0;
+uint32_t txn_revoke_count = 0;      // freed blocks still revoked
+block_index_t txn_revoke_index;     // the position of each of them in txn_frees
+
+journal_stats_t journal_stats;
+
+// guards everything above, recursive so that the free bit map can add its
+// blocks while a commit holds it. Operations changing metadata are
+// bracketed by journal_begin and journal_end, and a commit waits for the
+// running ones to end so that it never holds half of an operation.
+pthread_mutex_t journal_mutex;
+pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+pthread_once_t journal_once = PTHREAD_ONCE_INIT;
+int journal_updates = 0;            // operations between journal_begin and journal_end
+int journal_committing = 0;         // a commit is waiting for them or writing
+
+static void init_mutex() {
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&journal_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void lock_journal() {
+    pthread_once(&journal_once, init_mutex);
+    pthread_mutex_lock(&journal_mutex);
+}
+
+void unlock_journal() {
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+static uint32_t checksum(const void* data, size_t length) {
+    const uint8_t* bytes = data;
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < length; ++i)
+        h = (h ^ bytes[i]) * 16777619u;
+    return h;
+}
+
+static uint32_t index_slot(block_index_t* idx, uint32_t block) {
+    uint32_t h = block * 2654435761u;
+    return (h ^ (h >> 16)) & idx->mask;
+}
+
+/**
+ * @return the value stored for the block, INDEX_EMPTY if there is none
+ */
+static uint32_t index_find(block_index_t* idx, uint32_t block) {
+    if (idx->count == 0)
+        return INDEX_EMPTY;
+    for (uint32_t s = index_slot(idx, block); idx->keys[s] != 0; s = (s + 1) & idx->mask)
+        if (idx->keys[s] == block + 1)
+            return idx->values[s];
+    return INDEX_EMPTY;
+}
+
+static int index_put(block_index_t* idx, uint32_t block, uint32_t value);
+
+/**
+ * @return 0 on success, -1 if memory ran out, the index is unchanged then
+ */
+static int index_grow(block_index_t* idx) {
+    uint32_t* keys = idx->keys;
+    uint32_t* values = idx->values;
+    uint32_t size = keys == NULL ? 0 : idx->mask + 1;
+    uint32_t mask = size == 0 ? 127 : 2 * size - 1;
+
+    // kept at most half full so that the probes stay short
+    uint32_t* new_keys = calloc(mask + 1, sizeof(uint32_t));
+    uint32_t* new_values = malloc((mask + 1) * sizeof(uint32_t));
+    if (new_keys == NULL || new_values == NULL) {
+        free(new_keys);
+        free(new_values);
+        return -1;
+    }
+    idx->keys = new_keys;
+    idx->values = new_values;
+    idx->mask = mask;
+    idx->count = 0;
+    for (uint32_t s = 0; s < size; ++s)
+        if (keys[s] != 0)
+            index_put(idx, keys[s] - 1, values[s]);
+    free(keys);
+    free(values);
+    return 0;
+}
+
+/**
+ * @return 0 on success, -1 if memory ran out and the index is full
+ */
+static int index_put(block_index_t* idx, uint32_t block, uint32_t value) {
+    if (idx->keys == NULL || 2 * (idx->count + 1) > idx->mask + 1)
+        if (index_grow(idx) < 0 && (idx->keys == NULL || idx->count + 1 > idx->mask))
+            return -1;
+    uint32_t s = index_slot(idx, block);
+    while (idx->keys[s] != 0 && idx->keys[s] != block + 1)
+        s = (s + 1) & idx->mask;
+    if (idx->keys[s] == 0)
+        ++idx->count;
+    idx->keys[s] = block + 1;
+    idx->values[s] = value;
+    return 0;
+}
+
+static void index_remove(block_index_t* idx, uint32_t block) {
+    if (idx->count == 0)
+        return;
+    uint32_t s = index_slot(idx, block);
+    while (idx->keys[s] != block + 1) {
+        if (idx->keys[s] == 0)
+            return;
+        s = (s + 1) & idx->mask;
+    }
+
+    // move back the entries after it that would no longer be found
+    for (uint32_t next = (s + 1) & idx->mask; idx->keys[next] != 0; next = (next + 1) & idx->mask) {
+        uint32_t home = index_slot(idx, idx->keys[next] - 1);
+        if (((next - home) & idx->mask) >= ((next - s) & idx->mask)) {
+            idx->keys[s] = idx->keys[next];
+            idx->values[s] = idx->values[next];
+            s = next;
+        }
+    }
+    idx->keys[s] = 0;
+    --idx->count;
+}
+
+static void index_clear(block_index_t* idx) {
+    if (idx->count > 0)
+        memset(idx->keys, 0, (idx->mask + 1) * sizeof(uint32_t));
+    idx->count = 0;
+}
+
+static void index_free(block_index_t* idx) {
+    free(idx->keys);
+    free(idx->values);
+    memset(idx, 0, sizeof(block_index_t));
+}
+
+static double elapsed_ms(struct timespec* start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void write_header() {
+    journal_block_t* header = calloc(1, journal_block_size);
+
+    header->magic = JOURNAL_MAGIC;
+    header->type = JOURNAL_HEADER;
+    header->seq = journal_seq;
+    write_blocks(journal_start, 1, header);
+    free(header);
+}
+
+void init_journal(uint32_t start, uint32_t nblocks, uint32_t block_size) {
+    pthread_once(&journal_once, init_mutex);
+    journal_updates = 0;
+    journal_committing = 0;
+    journal_start = start;
+    journal_nblocks = nblocks;
+    journal_block_size = block_size;
+    journal_next = 1;
+    journal_seq = 1;
+
+    free(txn_blocks);
+    free(txn_data);
+    free(txn_frees);
+    free(txn_revoked);
+    txn_blocks = NULL;
+    txn_data = NULL;
+    txn_frees = NULL;
+    txn_revoked = NULL;
+    index_free(&txn_index);
+    index_free(&txn_revoke_index);
+    txn_count = txn_capacity = 0;
+    txn_free_count = txn_free_capacity = txn_revoke_count = 0;
+    memset(&journal_stats, 0, sizeof(journal_stats));
+}
+
+void format_journal() {
+    journal_next = 1;
+    journal_seq = 1;
+    write_header();
+}
+
+void journal_begin() {
+    lock_journal();
+    while (journal_committing)
+        pthread_cond_wait(&journal_cond, &journal_mutex);
+    ++journal_updates;
+    unlock_journal();
+}
+
+void journal_end() {
+    lock_journal();
+    if (--journal_updates == 0)
+        pthread_cond_broadcast(&journal_cond);
+    unlock_journal();
+}
+
+void journal_add(uint32_t block, uint32_t nblocks, const void* data) {
+    lock_journal();
+    for (uint32_t k = 0; k < nblocks; ++k) {
+        const char* src = (const char*) data + (size_t) k * journal_block_size;
+
+        // a block changed again by the same transaction is only written once
+        uint32_t i = index_find(&txn_index, block + k);
+        if (i == INDEX_EMPTY) {
+            i = txn_count;
+            if (txn_count == txn_capacity) {
+                txn_capacity = txn_capacity == 0 ? 64 : 2 * txn_capacity;
+                txn_blocks = realloc(txn_blocks, txn_capacity * sizeof(uint32_t));
+                txn_data = realloc(txn_data, (size_t) txn_capacity * journal_block_size);
+            }
+            if (txn_count == 0 && txn_free_count == 0)
+                clock_gettime(CLOCK_MONOTONIC, &txn_started);
+            txn_blocks[txn_count++] = block + k;
+            index_put(&txn_index, block + k, i);
+        }
+        memcpy(txn_data + (size_t) i * journal_block_size, src, journal_block_size);
+
+        // the block is in use again, a revoke from this transaction no longer applies
+        uint32_t j = index_find(&txn_revoke_index, block + k);
+        if (j != INDEX_EMPTY) {
+            txn_revoked[j] = 0;
+            --txn_revoke_count;
+            index_remove(&txn_revoke_index, block + k);
+        }
+    }
+    unlock_journal();
+}
+
+int journal_read(uint32_t block, void* data) {
+    lock_journal();
+    uint32_t i = index_find(&txn_index, block);
+    int found = i != INDEX_EMPTY;
+    if (found)
+        memcpy(data, txn_data + (size_t) i * journal_block_size, journal_block_size);
+    unlock_journal();
+    return found;
+}
+
+void journal_free(uint32_t block, int revoke) {
+    lock_journal();
+    if (txn_free_count == txn_free_capacity) {
+        txn_free_capacity = txn_free_capacity == 0 ? 64 : 2 * txn_free_capacity;
+        txn_frees = realloc(txn_frees, txn_free_capacity * sizeof(uint32_t));
+        txn_revoked = realloc(txn_revoked, txn_free_capacity);
+    }
+    if (txn_count == 0 && txn_free_count == 0)
+        clock_gettime(CLOCK_MONOTONIC, &txn_started);
+    if (revoke) {
+        index_put(&txn_revoke_index, block, txn_free_count);
+        ++txn_revoke_count;
+    }
+    txn_frees[txn_free_count] = block;
+    txn_revoked[txn_free_count++] = revoke != 0;
+
+    // a freed metadata block doesn't need to be written
+    uint32_t i = revoke ? index_find(&txn_index, block) : INDEX_EMPTY;
+    if (i != INDEX_EMPTY) {
+        index_remove(&txn_index, block);
+        if (i != --txn_count) {
+            txn_blocks[i] = txn_blocks[txn_count];
+            memcpy(txn_data + (size_t) i * journal_block_size,
+                   txn_data + (size_t) txn_count * journal_block_size, journal_block_size);
+            index_put(&txn_index, txn_blocks[i], i);
+        }
+    }
+    unlock_journal();
+}
+
+uint32_t journal_pending_frees() {
+    lock_journal();
+    uint32_t count = txn_free_count;
+    unlock_journal();
+    return count;
+}
+
+int journal_fits(uint32_t nblocks, uint32_t nrevokes) {
+    lock_journal();
+    uint32_t count = txn_count + nblocks;
+    uint32_t ntags = count + txn_revoke_count + nrevokes;
+    uint32_t length = (ntags + TAGS_PER_DESCRIPTOR - 1) / TAGS_PER_DESCRIPTOR + count;
+    int fits = 1 + length + 1 <= journal_nblocks;
+    unlock_journal();
+    return fits;
+}
+
+int journal_commit_due(uint32_t batch_blocks, uint32_t interval_ms) {
+    int due = 0;
+
+    lock_journal();
+    if (txn_count > 0 || txn_free_count > 0)
+        due = txn_count >= batch_blocks || txn_free_count >= batch_blocks
+            || elapsed_ms(&txn_started) >= interval_ms;
+    unlock_journal();
+    return due;
+}
+
+int journal_checkpoint_due() {
+    lock_journal();
+    int due = journal_next > 1 + (journal_nblocks - 1) / 2;
+    unlock_journal();
+    return due;
+}
+
+void journal_checkpoint() {
+    lock_journal();
+    if (journal_next > 1) {
+        // the home locations of the committed blocks were written at commit
+        // time, make them durable before the journal space is reused
+        flush_disk();
+        write_header();
+        flush_disk();
+        journal_next = 1;
+        ++journal_stats.checkpoints;
+    }
+    unlock_journal();
+}
+
+/**
+ * Writes the running transaction, the journal lock is held
+ * and no operation is running
+ *
+ * @return 1 if a transaction was committed, 0 if there was nothing to commit
+ */
+static int commit_locked() {
+    // the blocks freed by this transaction can be reused once it is on disk
+    uint32_t nrevokes = txn_revoke_count;
+    for (uint32_t i = 0; i < txn_free_count; ++i)
+        rm_index(txn_frees[i]);
+    flush_bitmap();
+
+    if (txn_count == 0 && nrevokes == 0) {
+        txn_free_count = 0;
+        return 0;
+    }
+
+    uint32_t ntags = txn_count + nrevokes;
+    uint32_t ndesc = (ntags + TAGS_PER_DESCRIPTOR - 1) / TAGS_PER_DESCRIPTOR;
+    uint32_t length = ndesc + txn_count;
+
+    if (1 + length + 1 > journal_nblocks) {
+        // larger than the whole journal, write it in place without the
+        // crash guarantee rather than fail
+        journal_checkpoint();
+        for (uint32_t i = 0; i < txn_count; ++i)
+            write_blocks(txn_blocks[i], 1, txn_data + (size_t) i * journal_block_size);
+        flush_disk();
+        ++journal_stats.overflows;
+        txn_count = 0;
+        txn_free_count = txn_revoke_count = 0;
+        index_clear(&txn_index);
+        index_clear(&txn_revoke_index);
+        return 0;
+    }
+    if (journal_next + length + 1 > journal_nblocks)
+        // no room left, empty the journal now instead of in the background
+        journal_checkpoint();
+
+    // lay out the whole transaction so that it goes to the journal in one write
+    char* out = calloc(length + 1, journal_block_size);
+    uint32_t pos = 0;
+    uint32_t next_block = 0;
+    uint32_t next_revoke = 0;
+    while (pos < length) {
+        journal_descriptor_t* d = (journal_descriptor_t*) (out + (size_t) pos++ * journal_block_size);
+        d->h.magic = JOURNAL_MAGIC;
+        d->h.type = JOURNAL_DESCRIPTOR;
+        d->h.seq = journal_seq;
+
+        // revokes first, then the blocks, each one right after its descriptor
+        for (; d->count < TAGS_PER_DESCRIPTOR && next_revoke < txn_free_count; ++next_revoke)
+            if (txn_revoked[next_revoke]) {
+                d->tags[d->count].block = txn_frees[next_revoke];
+                d->tags[d->count++].flags = JOURNAL_TAG_REVOKE;
+            }
+        for (; d->count < TAGS_PER_DESCRIPTOR && next_block < txn_count; ++next_block) {
+            d->tags[d->count].block = txn_blocks[next_block];
+            d->tags[d->count++].flags = 0;
+            memcpy(out + (size_t) pos++ * journal_block_size,
+                   txn_data + (size_t) next_block * journal_block_size, journal_block_size);
+        }
+    }
+
+    journal_commit_t* c = (journal_commit_t*) (out + (size_t) length * journal_block_size);
+    c->h.magic = JOURNAL_MAGIC;
+    c->h.type = JOURNAL_COMMIT;
+    c->h.seq = journal_seq;
+    c->nblocks = length;
+    c->checksum = checksum(out, (size_t) length * journal_block_size);
+
+    // the file data written before the transaction reaches the disk before
+    // it, and the transaction before any of its blocks is written in place
+    flush_disk();
+    write_blocks(journal_start + journal_next, length + 1, out);
+    flush_disk();
+    free(out);
+
+    for (uint32_t i = 0; i < txn_count; ++i)
+        write_blocks(txn_blocks[i], 1, txn_data + (size_t) i * journal_block_size);
+
+    ++journal_stats.commits;
+    journal_stats.blocks += txn_count;
+    journal_stats.journal_writes += length + 1;
+    journal_next += length + 1;
+    ++journal_seq;
+    txn_count = 0;
+    txn_free_count = txn_revoke_count = 0;
+    index_clear(&txn_index);
+    index_clear(&txn_revoke_index);
+    return 1;
+}
+
+int journal_commit() {
+    lock_journal();
+
+    // wait for another commit, then for the running operations to end
+    while (journal_committing)
+        pthread_cond_wait(&journal_cond, &journal_mutex);
+    journal_committing = 1;
+    while (journal_updates > 0)
+        pthread_cond_wait(&journal_cond, &journal_mutex);
+
+    int res = commit_locked();
+
+    journal_committing = 0;
+    pthread_cond_broadcast(&journal_cond);
+    unlock_journal();
+    return res;
+}
+
+/**
+ * Reads a committed transaction from the journal
+ *
+ * @param  pos      the journal block the transaction starts at
+ * @param  seq      the sequence number it must have
+ * @param  buf      where the blocks of the transaction are read to, at least
+ *                  as large as the rest of the journal
+ * @return          the length of the transaction, commit block included,
+ *                  0 if there is no complete transaction there
+ */
+static uint32_t read_txn(uint32_t pos, uint64_t seq, char* buf) {
+    uint32_t length = 0;
+
+    while (pos + length < journal_nblocks) {
+        char* block = buf + (size_t) length * journal_block_size;
+        read_blocks(journal_start + pos + length, 1, block);
+
+        journal_block_t* h = (journal_block_t*) block;
+        if (h->magic != JOURNAL_MAGIC || h->seq != seq)
+            return 0;
+        if (h->type == JOURNAL_COMMIT) {
+            journal_commit_t* c = (journal_commit_t*) block;
+            if (c->nblocks != length || c->checksum != checksum(buf, (size_t) length * journal_block_size))
+                return 0;
+            return length + 1;
+        }
+        if (h->type != JOURNAL_DESCRIPTOR)
+            return 0;
+
+        // read the blocks described by this descriptor
+        journal_descriptor_t* d = (journal_descriptor_t*) block;
+        uint32_t count = 0;
+        if (d->count > TAGS_PER_DESCRIPTOR)
+            return 0;
+        for (uint32_t i = 0; i < d->count; ++i)
+            if (!(d->tags[i].flags & JOURNAL_TAG_REVOKE))
+                ++count;
+        if (pos + length + 1 + count >= journal_nblocks)
+            return 0;
+        read_blocks(journal_start + pos + length + 1, count, block + journal_block_size);
+        length += 1 + count;
+    }
+    return 0;
+}
+
+int replay_journal() {
+    journal_block_t* header = malloc(journal_block_size);
+    char* buf = malloc((size_t) journal_nblocks * journal_block_size);
+
+    if (header == NULL || buf == NULL) {
+        free(header);
+        free(buf);
+        return -2;
+    }
+    read_blocks(journal_start, 1, header);
+    if (header->magic != JOURNAL_MAGIC || header->type != JOURNAL_HEADER) {
+        free(header);
+        free(buf);
+        return -1;
+    }
+    uint64_t first_seq = header->seq;
+    free(header);
+
+    // first pass: find the committed transactions and the last one
+    // revoking each block, counted from the first one
+    block_index_t revoked;
+    uint64_t seq = first_seq;
+    uint32_t pos = 1;
+    uint32_t length;
+    memset(&revoked, 0, sizeof(revoked));
+    while ((length = read_txn(pos, seq, buf)) > 0) {
+        for (uint32_t b = 0; b < length - 1;) {
+            journal_descriptor_t* d = (journal_descriptor_t*) (buf + (size_t) b * journal_block_size);
+            uint32_t count = 0;
+            for (uint32_t i = 0; i < d->count; ++i) {
+                if (!(d->tags[i].flags & JOURNAL_TAG_REVOKE)) {
+                    ++count;
+                    continue;
+                }
+                if (index_put(&revoked, d->tags[i].block, seq - first_seq) < 0) {
+                    // nothing was written yet, the journal can be replayed later
+                    index_free(&revoked);
+                    free(buf);
+                    return -2;
+                }
+            }
+            b += 1 + count;
+        }
+        pos += length;
+        ++seq;
+    }
+    uint64_t end_seq = seq;
+
+    // second pass: write the blocks of the committed transactions in place,
+    // oldest first, skipping those freed by a later transaction
+    seq = first_seq;
+    pos = 1;
+    while (seq < end_seq && (length = read_txn(pos, seq, buf)) > 0) {
+        for (uint32_t b = 0; b < length - 1;) {
+            journal_descriptor_t* d = (journal_descriptor_t*) (buf + (size_t) b * journal_block_size);
+            uint32_t data = b + 1;
+            for (uint32_t i = 0; i < d->count; ++i) {
+                if (d->tags[i].flags & JOURNAL_TAG_REVOKE)
+                    continue;
+
+                uint32_t r = index_find(&revoked, d->tags[i].block);
+                if (r == INDEX_EMPTY || r <= seq - first_seq)
+                    write_blocks(d->tags[i].block, 1, buf + (size_t) data * journal_block_size);
+                ++data;
+            }
+            b = data;
+        }
+        pos += length;
+        ++seq;
+    }
+    index_free(&revoked);
+    free(buf);
+
+    // the replayed blocks are in place, start over with an empty journal
+    journal_seq = end_seq;
+    journal_next = 1;
+    flush_disk();
+    write_header();
+    flush_disk();
+    return end_seq - first_seq;
+}
+
+void get_journal_stats(journal_stats_t* stats) {
+    lock_journal();
+    *stats = journal_stats;
+    unlock_journal();
+}
+
+void reset_journal_stats() {
+    lock_journal();
+    memset(&journal_stats, 0, sizeof(journal_stats));
+    unlock_journal();
+}
@@ -4,77 +4,697 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 #define DISK "sfs_disk.disk"
-#define BLOCK_SZ 1024       // block size
-#define NUM_INODES 1024     // number of files (because there are no directories)
-#define NUM_INODE_BLOCKS (sizeof(inode_t) * NUM_INODES / BLOCK_SZ + 1)          // the number of inode blocks
-#define NUM_ROOT_DIR_BLOCKS (sizeof(dir_entry_t) * NUM_INODES / BLOCK_SZ + 1)   // the number of blocks used by the root directory
-#define NUM_IND_PTRS (BLOCK_SZ / sizeof(unsigned int))  // the number of pointers in the ind ptr block
-#define LAST_AVAILABLE_DATA_BLOCK NUM_BLOCKS - 1        // NUM_BLOCKS - the number of blocks used by the free bit map
+#define SFS_MAGIC 0xACBD0007
+#define MIN_BLOCK_SZ 512        // smallest supported block size, also used to probe the super block
+#define MAX_BLOCK_SZ (1 << 20)  // largest supported block size
+
+// the geometry of the mounted disk, all of it comes from the super block
+#define BLOCK_SZ ((uint32_t) sb.block_size)                 // block size
+#define NUM_BLOCKS ((uint32_t) (sb.fs_size / sb.block_size)) // number of blocks on the disk
+#define NUM_INODES ((uint32_t) sb.num_inodes)               // number of files (because there are no directories)
+#define NUM_INODE_BLOCKS ((uint32_t) sb.inode_table_len)    // the number of inode blocks
+#define NUM_ROOT_DIR_BLOCKS ((uint32_t) sb.root_dir_len)    // the number of blocks used by the root directory
+#define NUM_BITMAP_BLOCKS ((uint32_t) sb.bitmap_len)        // the number of blocks used by the free bit map
+#define NUM_JOURNAL_BLOCKS ((uint32_t) sb.journal_len)      // the number of blocks used by the journal
+#define JOURNAL_START (1 + NUM_INODE_BLOCKS + NUM_ROOT_DIR_BLOCKS) // the journal follows the root directory
+#define NUM_IND_PTRS (BLOCK_SZ / sizeof(unsigned int))      // the number of pointers in the ind ptr block
+#define BITMAP_START (NUM_BLOCKS - NUM_BITMAP_BLOCKS)       // the free bit map is stored in the last blocks
+#define LAST_AVAILABLE_DATA_BLOCK (BITMAP_START - 1)
+#define NAME_INDEX_SIZE (2 * NUM_INODES)                    // the number of slots in the file name hash index
+#define IND_CACHE_SIZE 64                                   // the number of indirect blocks kept in memory
+#define IO_BATCH_BLOCKS 1024                                // the number of blocks resolved at once by reads and writes
+#define IO_QUEUE_RUNS 32                                    // the number of runs a read or write keeps in flight
+#define RA_MIN_BLOCKS 4                                     // the first read ahead window of a sequential reader
+#define RA_MAX_BLOCKS 256                                   // the read ahead window stops doubling at this size
+#define WB_MAX_BYTES (128 << 10)                            // the most bytes buffered for one file
+#define WB_DIRTY_BYTES (8 << 20)                            // the most bytes buffered for all files together
+#define DEFRAG_CHUNK_BYTES (1 << 20)                        // the most file data sfs_defrag moves at once
+
+// group commit: the metadata changes of many operations go to the journal
+// together, once enough blocks changed or the oldest change is old enough
+#define JOURNAL_BATCH_BLOCKS (NUM_JOURNAL_BLOCKS / 4)
+#define JOURNAL_COMMIT_MS 50
+#define JOURNAL_CHECKPOINT_MS 1000
+#define WB_EXPIRE_MS 5000                                   // the buffered writes are written at least this often
+#define JOURNAL_MAX_BYTES (64 << 20)                        // the journal is at most this large
 
 // superblock
 superblock_t sb;
 
-// inode table
-inode_t table[NUM_INODES];
+// inode table, sized to whole blocks so it can be read and written block by block
+inode_t* table = NULL;
 
 // file descriptor table
-file_descriptor fdt[NUM_INODES];
+file_descriptor* fdt = NULL;
 
-// root directory table
-dir_entry_t root_directory[NUM_INODES];
+// root directory table, sized to whole blocks like the inode table
+dir_entry_t* root_directory = NULL;
+
+// blocks of the inode table and root directory changed since the last flush
+uint8_t* dirty_inode_blocks = NULL;
+uint8_t* dirty_dir_blocks = NULL;
 
 int current_dir_pos = 0;
 
-void init_superblock() {
-    sb.magic = 0xACBD0005;
-    sb.block_size = BLOCK_SZ;
-    sb.fs_size = NUM_BLOCKS * BLOCK_SZ;
-    sb.inode_table_len = NUM_INODE_BLOCKS;
+// file name hash index (open addressing, linear probing): the root directory
+// index of each file, 0 for an empty slot since entry 0 never holds a file
+uint32_t* name_index = NULL;
+
+// recently used indirect pointer blocks, direct-mapped by block number
+// (0 marks an empty slot, block 0 is the super block)
+unsigned int ind_cache_block[IND_CACHE_SIZE];
+unsigned int* ind_cache = NULL;             // IND_CACHE_SIZE blocks of pointers
+uint8_t ind_cache_dirty[IND_CACHE_SIZE];    // changed since the block was last written
+
+#define IND_CACHE_SLOT(_slot) (ind_cache + (size_t) (_slot) * NUM_IND_PTRS)
+
+// the small writes of an open file are buffered, and its blocks only
+// allocated once the buffer is written, see sfs_bufferwrite
+typedef struct {
+    char* data;         // WB_MAX_BYTES, allocated on first use and freed on the last close
+    uint64_t pos;       // the file position of data[0], at most the size of the file on disk
+    uint32_t len;       // the number of bytes buffered, 0 if none
+    uint32_t reserved;  // the free blocks set aside for writing them
+} write_buffer_t;
+
+write_buffer_t* wbufs = NULL;   // one per inode, guarded by its inode lock
+uint64_t wb_dirty = 0;          // bytes buffered by all files
+uint64_t wb_reserved = 0;       // blocks set aside by all files
+
+// stack of the unused root directory entries
+uint32_t* free_entries = NULL;
+int num_free_entries = 0;
+
+// locks, always taken in this order: the directory lock, an inode lock,
+// then an indirect cache slot lock or the metadata lock (never both). The
+// journal and the allocator have their own locks, taken after all of these.
+pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER;  // root directory, name index, free entries
+pthread_rwlock_t* inode_locks = NULL;       // per inode: the inode, the file's blocks and its descriptor
+uint32_t num_inode_locks = 0;
+pthread_mutex_t ind_cache_lock[IND_CACHE_SIZE];         // per indirect cache slot
+pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;  // the dirty flags of the inode table and root directory
+pthread_mutex_t readahead_lock = PTHREAD_MUTEX_INITIALIZER; // the read ahead state of the descriptors, taken alone
+pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;   // wb_dirty and wb_reserved, taken alone
+
+static int sfs_flushbuffer(int fileID);
+
+// a block of scratch space per thread for the partial block copies of
+// the backends that aren't mapped, see sfs_scratchblock
+pthread_key_t scratch_key;
+pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+// activity counters, see sfs_getstats. They are added to from any thread
+// with relaxed atomics rather than under a lock, reading them is rare
+sfs_stats_t sfs_stats;
+
+#define SFS_STAT_ADD(_field, _n) __atomic_add_fetch(&sfs_stats._field, (_n), __ATOMIC_RELAXED)
+
+// the journal thread commits and checkpoints in the background
+pthread_mutex_t journal_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journal_wakeup = PTHREAD_COND_INITIALIZER;
+pthread_t journal_thread;
+int mounted = 0;
+int journal_stop = 0;
+
+/**
+ * Computes the layout of a disk and stores it in the super block
+ *
+ * @param  block_size the block size in bytes, a power of two
+ * @param  num_blocks the number of blocks on the disk
+ * @param  num_inodes the number of files the disk can hold
+ * @return            0 on success, -1 if the geometry is not usable
+ */
+static int init_superblock(uint64_t block_size, uint64_t num_blocks, uint64_t num_inodes) {
+    if (block_size < MIN_BLOCK_SZ || block_size > MAX_BLOCK_SZ || (block_size & (block_size - 1)) != 0
+            || num_blocks > INT32_MAX || num_inodes < 2 || num_inodes > INT32_MAX)
+        return -1;
+
+    sb.magic = SFS_MAGIC;
+    sb.block_size = block_size;
+    sb.fs_size = num_blocks * block_size;
+    sb.inode_table_len = (sizeof(inode_t) * num_inodes + block_size - 1) / block_size;
     sb.root_dir_inode = 0;
+    sb.num_inodes = num_inodes;
+    sb.root_dir_len = (sizeof(dir_entry_t) * num_inodes + block_size - 1) / block_size;
+    sb.bitmap_len = (num_blocks + block_size * 8 - 1) / (block_size * 8);
+
+    // a 32nd of the disk for the journal, within bounds
+    sb.journal_len = num_blocks / 32;
+    if (sb.journal_len < 32)
+        sb.journal_len = 32;
+    if (sb.journal_len > JOURNAL_MAX_BYTES / block_size)
+        sb.journal_len = JOURNAL_MAX_BYTES / block_size;
+
+    // super block, inode table, root dir, journal & bit map, and room for data
+    if (1 + sb.inode_table_len + sb.root_dir_len + sb.journal_len + sb.bitmap_len >= num_blocks)
+        return -1;
+    return 0;
 }
 
-void mksfs(int fresh) {
-    if (fresh) {
-        // create super block
-        init_superblock();
-
-        // init root directory & fdt
-        for (int i = 0; i < NUM_INODES; ++i) {
-            root_directory[i].inode = 0;
-            fdt[i].inode = 0;
+/**
+ * Allocates the in-memory tables for the geometry in the super block
+ */
+static void sfs_alloctables() {
+    for (uint32_t i = 0; i < num_inode_locks; ++i)
+        pthread_rwlock_destroy(&inode_locks[i]);
+    if (inode_locks != NULL)
+        for (int i = 0; i < IND_CACHE_SIZE; ++i)
+            pthread_mutex_destroy(&ind_cache_lock[i]);
+    free(inode_locks);
+    if (wbufs != NULL)
+        for (uint32_t i = 0; i < num_inode_locks; ++i)
+            free(wbufs[i].data);
+    free(wbufs);
+    free(table);
+    free(fdt);
+    free(root_directory);
+    free(dirty_inode_blocks);
+    free(dirty_dir_blocks);
+    free(name_index);
+    free(ind_cache);
+    free(free_entries);
+
+    table = calloc(NUM_INODE_BLOCKS, BLOCK_SZ);
+    fdt = calloc(NUM_INODES, sizeof(file_descriptor));
+    root_directory = calloc(NUM_ROOT_DIR_BLOCKS, BLOCK_SZ);
+    dirty_inode_blocks = calloc(NUM_INODE_BLOCKS, 1);
+    dirty_dir_blocks = calloc(NUM_ROOT_DIR_BLOCKS, 1);
+    name_index = calloc(NAME_INDEX_SIZE, sizeof(uint32_t));
+    ind_cache = calloc(IND_CACHE_SIZE, BLOCK_SZ);
+    free_entries = calloc(NUM_INODES, sizeof(uint32_t));
+    wbufs = calloc(NUM_INODES, sizeof(write_buffer_t));
+    wb_dirty = 0;
+    wb_reserved = 0;
+    inode_locks = malloc(NUM_INODES * sizeof(pthread_rwlock_t));
+    num_inode_locks = NUM_INODES;
+    for (uint32_t i = 0; i < num_inode_locks; ++i)
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    for (int i = 0; i < IND_CACHE_SIZE; ++i)
+        pthread_mutex_init(&ind_cache_lock[i], NULL);
+    memset(ind_cache_block, 0, sizeof(ind_cache_block));
+    memset(ind_cache_dirty, 0, sizeof(ind_cache_dirty));
+    current_dir_pos = 0;
+}
+
+/**
+ * Marks the blocks of a metadata region holding the given bytes as dirty
+ *
+ * @param dirty  the dirty flags of the region, one per block
+ * @param offset the byte offset of the change in the region
+ * @param length the number of bytes changed
+ */
+static void sfs_markdirty(uint8_t* dirty, size_t offset, size_t length) {
+    for (size_t i = offset / BLOCK_SZ; i <= (offset + length - 1) / BLOCK_SZ; ++i)
+        dirty[i] = 1;
+}
+
+/**
+ * Marks the inode table block(s) holding an inode as dirty
+ *
+ * @param inode the inode number
+ */
+static void sfs_markinode(int inode) {
+    pthread_mutex_lock(&meta_lock);
+    sfs_markdirty(dirty_inode_blocks, inode * sizeof(inode_t), sizeof(inode_t));
+    pthread_mutex_unlock(&meta_lock);
+}
+
+/**
+ * Marks the root directory block(s) holding an entry as dirty
+ *
+ * @param index the index of the entry in the root directory
+ */
+static void sfs_markdirentry(int index) {
+    pthread_mutex_lock(&meta_lock);
+    sfs_markdirty(dirty_dir_blocks, index * sizeof(dir_entry_t), sizeof(dir_entry_t));
+    pthread_mutex_unlock(&meta_lock);
+}
+
+/**
+ * Adds the dirty blocks of a metadata region to the running
+ * transaction, adjacent dirty blocks together
+ *
+ * @param start   the first block of the region on disk
+ * @param data    the in-memory copy of the region
+ * @param dirty   the dirty flags of the region, one per block
+ * @param nblocks the number of blocks in the region
+ */
+static void sfs_flushregion(int start, void* data, uint8_t* dirty, int nblocks) {
+    for (int i = 0; i < nblocks; ++i) {
+        if (!dirty[i])
+            continue;
+
+        int n = 1;
+        while (i + n < nblocks && dirty[i + n])
+            ++n;
+        journal_add(start + i, n, (char*) data + (size_t) i * BLOCK_SZ);
+        memset(&dirty[i], 0, n);
+        i += n - 1;
+    }
+}
+
+/**
+ * Adds the cached indirect blocks changed since the last flush
+ * to the running transaction
+ */
+static void sfs_flushindblocks() {
+    for (int i = 0; i < IND_CACHE_SIZE; ++i) {
+        pthread_mutex_lock(&ind_cache_lock[i]);
+        if (ind_cache_dirty[i]) {
+            journal_add(ind_cache_block[i], 1, IND_CACHE_SLOT(i));
+            ind_cache_dirty[i] = 0;
         }
+        pthread_mutex_unlock(&ind_cache_lock[i]);
+    }
+}
+
+/**
+ * Adds the indirect, inode table, root directory and free bit map
+ * blocks that changed since the last flush to the running transaction.
+ * Blocks another thread is still changing may be copied half done,
+ * that thread adds them again when it is done, before they can be
+ * committed.
+ */
+static void sfs_gathermetadata() {
+    sfs_flushindblocks();
+    pthread_mutex_lock(&meta_lock);
+    sfs_flushregion(1, table, dirty_inode_blocks, sb.inode_table_len);
+    sfs_flushregion(1 + sb.inode_table_len, root_directory, dirty_dir_blocks, NUM_ROOT_DIR_BLOCKS);
+    pthread_mutex_unlock(&meta_lock);
+    flush_bitmap();
+}
 
-        init_fresh_disk(DISK, BLOCK_SZ, NUM_BLOCKS);
+/**
+ * Ends an operation started with journal_begin. Its metadata changes are
+ * committed with those of the operations before it once the running
+ * transaction is large enough, otherwise the journal thread commits them
+ * shortly.
+ */
+static void sfs_flushmetadata() {
+    SFS_STAT_ADD(metadata_flushes, 1);
+    sfs_gathermetadata();
+    journal_end();
+    if (journal_commit_due(JOURNAL_BATCH_BLOCKS, JOURNAL_COMMIT_MS))
+        journal_commit();
+    if (journal_checkpoint_due())
+        pthread_cond_signal(&journal_wakeup);
+}
 
-        // write the super block, the inode table and the root dir table
-        write_blocks(0, 1, &sb);
-        write_blocks(1, sb.inode_table_len, table);
-        write_blocks(1 + sb.inode_table_len, NUM_ROOT_DIR_BLOCKS, root_directory);
+/**
+ * Commits the running transaction if it frees blocks and fewer than
+ * an operation needs are free, so that it can use them. Called before
+ * the operation's journal_begin, the transaction committed holds only
+ * complete operations. The frees can't be used inside the transaction
+ * that makes them: the data written to the blocks reaches the disk
+ * before the transaction commits, over what a crash would bring back.
+ *
+ * @param blocks the number of free blocks the operation takes at most
+ */
+static void sfs_reserve(uint64_t blocks) {
+    if (blocks > get_free_count() && journal_pending_frees() > 0)
+        journal_commit();
+}
 
-        // populate the free bitmap
-        int free_index = 0;
-        force_set_index(free_index++);                              // super block
-        for (int i = 0; i < sb.inode_table_len; ++i, ++free_index)  // inode table
-            force_set_index(free_index);
-        for (int i = 0; i < NUM_ROOT_DIR_BLOCKS; ++i, ++free_index) // root dir table
-            force_set_index(free_index);
-        force_set_index(LAST_AVAILABLE_DATA_BLOCK);                 // free bit map
+/**
+ * Hashes a file name (FNV-1a)
+ *
+ * @param  name the file name
+ * @return      the home slot of the name in the name index
+ */
+static uint32_t sfs_hashname(const char* name) {
+    uint32_t h = 2166136261u;
 
-        // write the free bitmap to the last block
-        write_blocks(LAST_AVAILABLE_DATA_BLOCK, 1, free_bit_map);
-    } else {
-        // reopening file system
-        init_disk(DISK, BLOCK_SZ, NUM_BLOCKS);
+    for (; *name != '\0'; ++name)
+        h = (h ^ (uint8_t) *name) * 16777619u;
+    return h % NAME_INDEX_SIZE;
+}
 
-        // read super block, inode table, root dir table, and free bit map
-        read_blocks(0, 1, &sb);
-        read_blocks(1, sb.inode_table_len, table);
-        read_blocks(1 + sb.inode_table_len, NUM_ROOT_DIR_BLOCKS, root_directory);
-        read_blocks(LAST_AVAILABLE_DATA_BLOCK, 1, free_bit_map);
+/**
+ * Finds a file in the root directory
+ *
+ * @param  name the file name
+ * @return      the index of the file in the root directory, -1 if it does not exist
+ */
+static int sfs_lookup(const char* name) {
+    int res = -1;
+    uint32_t probes = 0;
+
+    for (uint32_t i = sfs_hashname(name); name_index[i] != 0; i = (i + 1) % NAME_INDEX_SIZE) {
+        ++probes;
+        if (strcmp(root_directory[name_index[i]].filename, name) == 0) {
+            res = name_index[i];
+            break;
+        }
+    }
+    SFS_STAT_ADD(lookups, 1);
+    SFS_STAT_ADD(lookup_probes, probes);
+    return res;
+}
+
+/**
+ * Adds a root directory entry to the name index
+ *
+ * @param index the index of the entry in the root directory
+ */
+static void sfs_indexname(uint32_t index) {
+    uint32_t i = sfs_hashname(root_directory[index].filename);
+
+    while (name_index[i] != 0)
+        i = (i + 1) % NAME_INDEX_SIZE;
+    name_index[i] = index;
+}
+
+/**
+ * Removes a root directory entry from the name index, moving back the
+ * entries that follow it so that no probe sequence is broken
+ *
+ * @param index the index of the entry in the root directory
+ */
+static void sfs_unindexname(uint32_t index) {
+    uint32_t i = sfs_hashname(root_directory[index].filename);
+
+    while (name_index[i] != index)
+        i = (i + 1) % NAME_INDEX_SIZE;
+
+    for (uint32_t j = (i + 1) % NAME_INDEX_SIZE; name_index[j] != 0; j = (j + 1) % NAME_INDEX_SIZE) {
+        uint32_t home = sfs_hashname(root_directory[name_index[j]].filename);
+
+        // the entry at j can fill the hole at i if its home slot is not in (i, j]
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            name_index[i] = name_index[j];
+            i = j;
+        }
+    }
+    name_index[i] = 0;
+}
+
+/**
+ * Rebuilds the name index and the list of free root directory
+ * entries from the root directory
+ */
+static void sfs_buildindex() {
+    memset(name_index, 0, NAME_INDEX_SIZE * sizeof(uint32_t));
+    num_free_entries = 0;
+    for (int i = NUM_INODES - 1; i > 0; --i) {
+        if (root_directory[i].inode != 0)
+            sfs_indexname(i);
+        else
+            free_entries[num_free_entries++] = i;
     }
-    return;
+}
+
+/**
+ * Writes the buffered writes of every file
+ *
+ * @return 0 on success, -5 if the file system filled up before some fit
+ */
+static int sfs_flushbuffers() {
+    pthread_mutex_lock(&wb_lock);
+    uint64_t dirty = wb_dirty;
+    pthread_mutex_unlock(&wb_lock);
+    if (dirty == 0)
+        return 0;
+
+    int res = 0;
+    for (uint32_t i = 1; i < NUM_INODES; ++i) {
+        pthread_rwlock_wrlock(&inode_locks[i]);
+        if (sfs_flushbuffer(i) < 0)
+            res = -5;
+        pthread_rwlock_unlock(&inode_locks[i]);
+    }
+    return res;
+}
+
+/**
+ * Commits the metadata changes that are old enough and checkpoints the
+ * journal when it fills up or hasn't been for a while, in the background.
+ * Also writes the buffered writes of every file every WB_EXPIRE_MS.
+ */
+static void* sfs_journalthread(void* arg) {
+    struct timespec last_checkpoint, last_writeback;
+
+    clock_gettime(CLOCK_MONOTONIC, &last_checkpoint);
+    last_writeback = last_checkpoint;
+    pthread_mutex_lock(&journal_thread_lock);
+    while (!journal_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += JOURNAL_COMMIT_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        if (pthread_cond_timedwait(&journal_wakeup, &journal_thread_lock, &deadline) != ETIMEDOUT && journal_stop)
+            break;
+        pthread_mutex_unlock(&journal_thread_lock);
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - last_writeback.tv_sec) * 1000
+                + (now.tv_nsec - last_writeback.tv_nsec) / 1000000 >= WB_EXPIRE_MS) {
+            sfs_flushbuffers();
+            last_writeback = now;
+        }
+
+        if (journal_commit_due(JOURNAL_BATCH_BLOCKS, JOURNAL_COMMIT_MS))
+            journal_commit();
+
+        if (journal_checkpoint_due() || (now.tv_sec - last_checkpoint.tv_sec) * 1000
+                + (now.tv_nsec - last_checkpoint.tv_nsec) / 1000000 >= JOURNAL_CHECKPOINT_MS) {
+            journal_checkpoint();
+            last_checkpoint = now;
+        }
+        pthread_mutex_lock(&journal_thread_lock);
+    }
+    pthread_mutex_unlock(&journal_thread_lock);
+    return NULL;
+}
+
+/**
+ * @return the time of the monotonic clock in nanoseconds
+ */
+static uint64_t sfs_clock() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+/**
+ * Counts a call and the time spent in it
+ *
+ * @param  op    the SFS_OP_ kind of the call
+ * @param  start what sfs_clock returned when the call began
+ * @param  res   the result of the call, the number of bytes moved by reads and writes
+ * @return       res
+ */
+static int sfs_endop(int op, uint64_t start, int res) {
+    if (op == SFS_OP_READ && res > 0)
+        SFS_STAT_ADD(bytes_read, res);
+    else if (op == SFS_OP_WRITE && res > 0)
+        SFS_STAT_ADD(bytes_written, res);
+    SFS_STAT_ADD(op_count[op], 1);
+    SFS_STAT_ADD(op_ns[op], sfs_clock() - start);
+    return res;
+}
+
+/**
+ * Finishes mounting the disk opened by mksfs_geometry or sfs_reopen
+ */
+static void sfs_mount() {
+    memset(&sfs_stats, 0, sizeof(sfs_stats));
+    sfs_buildindex();
+    journal_stop = 0;
+    pthread_create(&journal_thread, NULL, sfs_journalthread, NULL);
+    mounted = 1;
+}
+
+/**
+ * Unmounts the disk: commits the pending metadata changes, checkpoints
+ * the journal and closes the disk. Does nothing if no disk is mounted.
+ */
+void sfs_unmount() {
+    if (!mounted)
+        return;
+
+    pthread_mutex_lock(&journal_thread_lock);
+    journal_stop = 1;
+    pthread_cond_signal(&journal_wakeup);
+    pthread_mutex_unlock(&journal_thread_lock);
+    pthread_join(journal_thread, NULL);
+
+    sfs_flushbuffers();
+    sfs_gathermetadata();
+    journal_commit();
+    journal_checkpoint();
+    close_disk();
+    mounted = 0;
+}
+
+/**
+ * Writes the buffered writes and commits the pending metadata
+ * changes, making every operation done so far durable
+ *
+ * @return 0 on success, -1 if no disk is mounted, -5 if the file
+ *         system filled up before the buffered writes fit
+ */
+int sfs_sync() {
+    if (!mounted)
+        return -1;
+
+    uint64_t start = sfs_clock();
+    int res = sfs_flushbuffers();
+
+    // the changes of the operations running now are committed too
+    journal_begin();
+    sfs_gathermetadata();
+    journal_end();
+    if (!journal_commit())
+        flush_disk();
+    return sfs_endop(SFS_OP_SYNC, start, res < 0 ? res : 0);
+}
+
+/**
+ * Gets the activity counters of the file system. Those of the layers
+ * below it are read with get_journal_stats, get_alloc_stats and
+ * get_cache_stats.
+ *
+ * @param stats the counters are returned here
+ */
+void sfs_getstats(sfs_stats_t* stats) {
+    // every counter is an unsigned long
+    for (size_t i = 0; i < sizeof(sfs_stats) / sizeof(unsigned long); ++i)
+        ((unsigned long*) stats)[i] = __atomic_load_n((unsigned long*) &sfs_stats + i, __ATOMIC_RELAXED);
+}
+
+/**
+ * Resets the activity counters of the file system, the journal,
+ * the allocator and the block cache
+ */
+void sfs_resetstats() {
+    for (size_t i = 0; i < sizeof(sfs_stats) / sizeof(unsigned long); ++i)
+        __atomic_store_n((unsigned long*) &sfs_stats + i, 0, __ATOMIC_RELAXED);
+    reset_journal_stats();
+    reset_alloc_stats();
+    reset_cache_stats();
+}
+
+/**
+ * Formats a new disk with the given geometry and mounts it
+ *
+ * @param  block_size the block size in bytes, a power of two between 512 B and 1 MiB
+ * @param  fs_size    the size of the disk in bytes, rounded down to whole blocks
+ * @param  num_inodes the maximum number of files
+ * @return            0 on success, -1 if the geometry is not usable or the disk can't be created
+ */
+int mksfs_geometry(int block_size, uint64_t fs_size, int num_inodes) {
+    sfs_unmount();
+
+    // create super block, allowing for the unused root directory entry 0
+    if (block_size <= 0 || init_superblock(block_size, fs_size / block_size, (uint64_t) num_inodes + 1) != 0) {
+        printf("Invalid file system geometry\n");
+        return -1;
+    }
+    sfs_alloctables();
+
+    if (init_fresh_disk(DISK, BLOCK_SZ, NUM_BLOCKS) != 0)
+        return -1;
+
+    // write the super block, the inode table, the root dir table and an empty journal
+    char* sb_block = calloc(1, BLOCK_SZ);
+    memcpy(sb_block, &sb, sizeof(sb));
+    write_blocks(0, 1, sb_block);
+    free(sb_block);
+    write_blocks(1, sb.inode_table_len, table);
+    write_blocks(1 + sb.inode_table_len, NUM_ROOT_DIR_BLOCKS, root_directory);
+    init_journal(JOURNAL_START, NUM_JOURNAL_BLOCKS, BLOCK_SZ);
+    format_journal();
+
+    // populate the free bitmap
+    init_bitmap(NUM_BLOCKS, BITMAP_START, BLOCK_SZ);
+    uint32_t free_index = 0;
+    force_set_index(free_index++);                                  // super block
+    for (uint32_t i = 0; i < NUM_INODE_BLOCKS; ++i, ++free_index)   // inode table
+        force_set_index(free_index);
+    for (uint32_t i = 0; i < NUM_ROOT_DIR_BLOCKS; ++i, ++free_index)// root dir table
+        force_set_index(free_index);
+    for (uint32_t i = 0; i < NUM_JOURNAL_BLOCKS; ++i, ++free_index) // journal
+        force_set_index(free_index);
+    for (uint32_t i = BITMAP_START; i < NUM_BLOCKS; ++i)            // free bit map
+        force_set_index(i);
+
+    // write the free bitmap to the last blocks
+    journal_commit();
+    journal_checkpoint();
+
+    sfs_mount();
+    return 0;
+}
+
+/**
+ * Mounts the existing disk, with the geometry stored in its super block,
+ * after replaying the metadata changes committed to its journal
+ *
+ * @return 0 on success, -1 if there is no valid file system on the disk
+ */
+int sfs_reopen() {
+    char probe[MIN_BLOCK_SZ];
+    superblock_t disk_sb;
+
+    sfs_unmount();
+
+    // the super block sits at the start of block 0 whatever the block size,
+    // read it with the smallest block size first
+    if (init_disk(DISK, MIN_BLOCK_SZ, 1) != 0)
+        return -1;
+    read_blocks(0, 1, probe);
+    close_disk();
+    memcpy(&disk_sb, probe, sizeof(disk_sb));
+
+    if (disk_sb.magic != SFS_MAGIC || disk_sb.block_size == 0
+            || init_superblock(disk_sb.block_size, disk_sb.fs_size / disk_sb.block_size, disk_sb.num_inodes) != 0
+            || disk_sb.inode_table_len != sb.inode_table_len || disk_sb.root_dir_len != sb.root_dir_len
+            || disk_sb.journal_len != sb.journal_len || disk_sb.bitmap_len != sb.bitmap_len) {
+        printf("%s does not hold a valid file system\n", DISK);
+        return -1;
+    }
+    sb = disk_sb;
+    sfs_alloctables();
+
+    // reopening file system
+    if (init_disk(DISK, BLOCK_SZ, NUM_BLOCKS) != 0)
+        return -1;
+
+    // bring the metadata up to date with the journal
+    init_journal(JOURNAL_START, NUM_JOURNAL_BLOCKS, BLOCK_SZ);
+    int replayed = replay_journal();
+    if (replayed < 0) {
+        if (replayed == -2)
+            printf("%s: out of memory replaying the journal\n", DISK);
+        else
+            printf("%s has no valid journal\n", DISK);
+        close_disk();
+        return -1;
+    }
+
+    // read inode table, root dir table, and free bit map
+    read_blocks(1, sb.inode_table_len, table);
+    read_blocks(1 + sb.inode_table_len, NUM_ROOT_DIR_BLOCKS, root_directory);
+    init_bitmap(NUM_BLOCKS, BITMAP_START, BLOCK_SZ);
+    load_bitmap();
+
+    sfs_mount();
+    return 0;
+}
+
+void mksfs(int fresh) {
+    if (fresh)
+        mksfs_geometry(DEFAULT_BLOCK_SZ, (uint64_t) DEFAULT_NUM_BLOCKS * DEFAULT_BLOCK_SZ, DEFAULT_NUM_INODES - 1);
+    else
+        sfs_reopen();
 }
 
 /**
@@ -86,13 +706,17 @@ void mksfs(int fresh) {
  *                  1 if there might be files left
  */
 int sfs_getnextfilename(char *fname) {
+    uint64_t start = sfs_clock();
+
+    pthread_rwlock_wrlock(&dir_lock);
     if (current_dir_pos != NUM_INODES)
         do {
             // check if it's a valid file and not the root node
             if (root_directory[current_dir_pos].inode != 0) {
                 strcpy(fname, root_directory[current_dir_pos].filename);
                 current_dir_pos++;
-                return 1;
+                pthread_rwlock_unlock(&dir_lock);
+                return sfs_endop(SFS_OP_READDIR, start, 1);
             }
             current_dir_pos++;
             current_dir_pos %= NUM_INODES;
@@ -100,7 +724,81 @@ int sfs_getnextfilename(char *fname) {
 
     // all files have been returned
     current_dir_pos = 0;
-    return 0;
+    pthread_rwlock_unlock(&dir_lock);
+    return sfs_endop(SFS_OP_READDIR, start, 0);
+}
+
+/**
+ * Gets the size of a file including its buffered writes, the inode lock is held
+ *
+ * @param  i the index of the file
+ * @return   the size in bytes
+ */
+static uint64_t sfs_filesize(int i) {
+    uint64_t end = wbufs[i].pos + wbufs[i].len;
+    return wbufs[i].len > 0 && end > table[i].size ? end : table[i].size;
+}
+
+/**
+ * Fills the attributes of a file, the directory lock is held
+ *
+ * @param i  the index of the file in the root directory
+ * @param st the attributes are returned here
+ */
+static void sfs_fillstat(int i, sfs_stat_t* st) {
+    pthread_rwlock_rdlock(&inode_locks[i]);
+    st->inode = root_directory[i].inode;
+    st->size = sfs_filesize(st->inode);
+    st->block_size = BLOCK_SZ;
+    pthread_rwlock_unlock(&inode_locks[i]);
+}
+
+/**
+ * Gets the next file of the root directory with its attributes. Unlike
+ * sfs_getnextfilename the position is kept by the caller, so listings
+ * can run in parallel and resume where they stopped.
+ *
+ * @param  pos   the position to look from, 0 for the first file, moved
+ *               past the file returned
+ * @param  fname where the name will be stored
+ * @param  st    where the attributes will be stored, can be NULL
+ * @return       1 if a file was returned, 0 if there are no files left
+ */
+int sfs_getnextentry(uint32_t* pos, char *fname, sfs_stat_t* st) {
+    uint64_t start = sfs_clock();
+
+    pthread_rwlock_rdlock(&dir_lock);
+    // entry 0 belongs to the root directory itself
+    for (uint32_t i = *pos > 0 ? *pos : 1; i < NUM_INODES; ++i)
+        if (root_directory[i].inode != 0) {
+            strcpy(fname, root_directory[i].filename);
+            if (st != NULL)
+                sfs_fillstat(i, st);
+            *pos = i + 1;
+            pthread_rwlock_unlock(&dir_lock);
+            return sfs_endop(SFS_OP_READDIR, start, 1);
+        }
+    *pos = NUM_INODES;
+    pthread_rwlock_unlock(&dir_lock);
+    return sfs_endop(SFS_OP_READDIR, start, 0);
+}
+
+/**
+ * Gets the attributes of a file
+ *
+ * @param  path the file name
+ * @param  st   the attributes are returned here
+ * @return      0 on success, -1 if the file was not found
+ */
+int sfs_stat(const char* path, sfs_stat_t* st) {
+    uint64_t start = sfs_clock();
+
+    pthread_rwlock_rdlock(&dir_lock);
+    int i = sfs_lookup(path);
+    if (i != -1)
+        sfs_fillstat(i, st);
+    pthread_rwlock_unlock(&dir_lock);
+    return sfs_endop(SFS_OP_STAT, start, i == -1 ? -1 : 0);
 }
 
 /**
@@ -109,163 +807,1005 @@ int sfs_getnextfilename(char *fname) {
  * @param  path the file name
  * @return      the size of the file or -1 if the file was not found
  */
-int sfs_getfilesize(const char* path) {
+int64_t sfs_getfilesize(const char* path) {
+    uint64_t start = sfs_clock();
+
     // look for the file
-    for (int i = 1; i < NUM_INODES; ++i)
-        if (root_directory[i].inode != 0 && strcmp(root_directory[i].filename, path) == 0)
-            // return its size
-            return table[root_directory[i].inode].size;
-    // file does not exist
-    return -1;
+    pthread_rwlock_rdlock(&dir_lock);
+    int i = sfs_lookup(path);
+    if (i == -1) {
+        // file does not exist
+        pthread_rwlock_unlock(&dir_lock);
+        return sfs_endop(SFS_OP_STAT, start, -1);
+    }
+
+    // return its size
+    pthread_rwlock_rdlock(&inode_locks[i]);
+    int64_t size = sfs_filesize(root_directory[i].inode);
+    pthread_rwlock_unlock(&inode_locks[i]);
+    pthread_rwlock_unlock(&dir_lock);
+    sfs_endop(SFS_OP_STAT, start, 0);
+    return size;
 }
 
 /**
- * Open an already existing file, or create one and then open it
- * if it doesn't already exist
+ * Forgets the access pattern of a descriptor, a read at the start of the
+ * file counts as sequential
  *
- * @param  name the file name
- * @return      the index of the opened file in the file descriptor table
+ * @param f the descriptor
  */
-int sfs_fopen(char *name) {
-    // reject files with filenames longer than the maximum
-    if (strlen(name) > MAXFILENAME)
-        return -1;
+static void sfs_resetreadahead(file_descriptor* f) {
+    pthread_mutex_lock(&readahead_lock);
+    f->ra_next = 0;
+    f->ra_window = 0;
+    f->ra_end = 0;
+    pthread_mutex_unlock(&readahead_lock);
+}
 
-    // look for the file
-    for (int i = 1; i < NUM_INODES; ++i)
-        if (root_directory[i].inode != 0 && strcmp(root_directory[i].filename, name) == 0) {
-            // file found
-            if (fdt[i].inode != 0)
-                // file already open
-                return -2;
+/**
+ * Opens a file found in the root directory, the directory lock is held
+ *
+ * @param  i      the index of the file in the root directory
+ * @param  shared whether an open file gets one more reference
+ * @return        the index of the opened file in the file descriptor table,
+ *                -2 if it is already open and not shared
+ */
+static int sfs_openexisting(int i, int shared) {
+    pthread_rwlock_wrlock(&inode_locks[i]);
+    if (fdt[i].inode != 0) {
+        // file already open
+        int res = shared ? i : -2;
+        if (shared)
+            ++fdt[i].refs;
+        pthread_rwlock_unlock(&inode_locks[i]);
+        return res;
+    }
 
-            // open file,
-            fdt[i].inode = root_directory[i].inode;
+    // open file,
+    fdt[i].inode = root_directory[i].inode;
+    fdt[i].refs = 1;
+    sfs_resetreadahead(&fdt[i]);
 
-            // open in append mode (set the r/w pointer to the end of the file)
-            sfs_fseek(i, table[i].size);
+    // open in append mode (set the r/w pointer to the end of the file)
+    fdt[i].rwptr = table[i].size;
 
-            return i;
-        }
+    pthread_rwlock_unlock(&inode_locks[i]);
+    return i;
+}
 
-    // file not found, create it
+/**
+ * Opens a file, creating it if it doesn't exist
+ *
+ * @param  name   the file name
+ * @param  shared whether opening an open file adds a reference to it
+ * @return        the index of the opened file in the file descriptor table,
+ *                -1 if the name is too long, -2 if the file is already open
+ *                and not shared, -3 if there is no free entry for a new file,
+ *                -4 if the disk is full
+ */
+static int sfs_openfile(char *name, int shared) {
+    // reject files with filenames longer than the maximum
+    // (the name and its terminator have to fit in the directory entry)
+    if (strlen(name) >= MAXFILENAME)
+        return -1;
 
-    // find new index
-    int file_index = -1;
-    for (int i = 1; i < NUM_INODES; ++i)
-        if (root_directory[i].inode == 0) {
-            // found free index
-            file_index = i;
-            break;
-        }
+    // look for the file, most opens are of existing files and
+    // don't keep the other ones from looking up theirs
+    pthread_rwlock_rdlock(&dir_lock);
+    int i = sfs_lookup(name);
+    if (i != -1) {
+        int res = sfs_openexisting(i, shared);
+        pthread_rwlock_unlock(&dir_lock);
+        return res;
+    }
+    pthread_rwlock_unlock(&dir_lock);
+
+    // file not found, look again with the directory locked
+    // for writing since another thread may have created it
+    pthread_rwlock_wrlock(&dir_lock);
+    i = sfs_lookup(name);
+    if (i != -1) {
+        int res = sfs_openexisting(i, shared);
+        pthread_rwlock_unlock(&dir_lock);
+        return res;
+    }
 
-    if (file_index == -1)
+    // create it
+
+    if (num_free_entries == 0) {
         // maximum file number reached
+        pthread_rwlock_unlock(&dir_lock);
         return -3;
+    }
+
+    // take a free index
+    int file_index = free_entries[--num_free_entries];
+    pthread_rwlock_wrlock(&inode_locks[file_index]);
+    sfs_reserve(1);
+    journal_begin();
 
     // find a free block
     int free_block_index = get_index();
+    if (free_block_index == 0) {
+        // disk full, give the index back
+        free_entries[num_free_entries++] = file_index;
+        journal_end();
+        pthread_rwlock_unlock(&inode_locks[file_index]);
+        pthread_rwlock_unlock(&dir_lock);
+        return -4;
+    }
 
     // create/initialize the inode
     inode_t* n = &table[file_index];
     n->size = 0;
-    memset(n->data_ptrs, 0, NUM_DIR_PTRS);
+    memset(n->data_ptrs, 0, sizeof(n->data_ptrs));
     n->ind_ptr = 0;
+    n->dbl_ind_ptr = 0;
+    n->tpl_ind_ptr = 0;
     n->data_ptrs[0] = free_block_index;
+    sfs_markinode(file_index);
 
     // update the root directory table
     dir_entry_t* d = &root_directory[file_index];
     d->inode = file_index;
     strcpy(d->filename, name);
+    sfs_markdirentry(file_index);
+    sfs_indexname(file_index);
 
-    // flush inode table, root dir & free bit map to disk
-    write_blocks(1, sb.inode_table_len, table);
-    write_blocks(1 + sb.inode_table_len, NUM_ROOT_DIR_BLOCKS, root_directory);
-    write_blocks(LAST_AVAILABLE_DATA_BLOCK, 1, free_bit_map);
+    // flush the changed inode, root dir & free bit map blocks to disk
+    sfs_flushmetadata();
 
     // update the fdt
     file_descriptor* f = &fdt[file_index];
     f->inode = d->inode;
     f->rwptr = 0;
+    f->refs = 1;
+    sfs_resetreadahead(f);
 
+    pthread_rwlock_unlock(&inode_locks[file_index]);
+    pthread_rwlock_unlock(&dir_lock);
     return file_index;
 }
 
 /**
- * Close a file
+ * Open an already existing file, or create one and then open it
+ * if it doesn't already exist
+ *
+ * @param  name the file name
+ * @return      the index of the opened file in the file descriptor table
+ */
+int sfs_fopen(char *name) {
+    uint64_t start = sfs_clock();
+    return sfs_endop(SFS_OP_OPEN, start, sfs_openfile(name, 0));
+}
+
+/**
+ * Open a file like sfs_fopen, except that a file which is already open
+ * is not an error: it gets one more reference, and stays open until
+ * sfs_fclose has been called once per reference
+ *
+ * @param  name the file name
+ * @return      the index of the opened file in the file descriptor table
+ */
+int sfs_fopenshared(char *name) {
+    uint64_t start = sfs_clock();
+    return sfs_endop(SFS_OP_OPEN, start, sfs_openfile(name, 1));
+}
+
+/**
+ * Gets the generation of a file descriptor table entry, which changes
+ * every time the file it describes is removed. Holders of a shared
+ * file keep it to tell a file created in the same entry from theirs.
  *
  * @param  fileID the file index in the file descriptor table
- * @return        0 on successful close, -1 otherwise
+ * @return        the generation of the entry
+ */
+uint32_t sfs_fgen(int fileID) {
+    pthread_rwlock_rdlock(&inode_locks[fileID]);
+    uint32_t gen = fdt[fileID].gen;
+    pthread_rwlock_unlock(&inode_locks[fileID]);
+    return gen;
+}
+
+/**
+ * Close a file, writing its buffered writes
+ *
+ * @param  fileID the file index in the file descriptor table
+ * @return        0 on successful close, -1 otherwise, -5 if the file
+ *                system filled up before the buffered writes fit
  */
 int sfs_fclose(int fileID) {
+    uint64_t start = sfs_clock();
     file_descriptor* f = &fdt[fileID];
 
-    if (f->inode == 0)
+    pthread_rwlock_wrlock(&inode_locks[fileID]);
+    if (f->inode == 0) {
         // file already closed
+        pthread_rwlock_unlock(&inode_locks[fileID]);
+        return sfs_endop(SFS_OP_CLOSE, start, -1);
+    }
+
+    int res = sfs_flushbuffer(fileID) < 0 ? -5 : 0;
+
+    // close the file once every reference is gone
+    if (--f->refs == 0) {
+        f->inode = 0;
+        free(wbufs[fileID].data);
+        wbufs[fileID].data = NULL;
+    }
+
+    pthread_rwlock_unlock(&inode_locks[fileID]);
+    return sfs_endop(SFS_OP_CLOSE, start, res);
+}
+
+/**
+ * Write the buffered writes of a file, allocating their blocks
+ *
+ * @param  fileID the file index in the file descriptor table
+ * @return        0 on success, -1 if the file is not open, -5 if the
+ *                file system filled up before the buffered writes fit
+ */
+int sfs_fflush(int fileID) {
+    uint64_t start = sfs_clock();
+
+    pthread_rwlock_wrlock(&inode_locks[fileID]);
+    int res = fdt[fileID].inode == 0 ? -1 : sfs_flushbuffer(fileID);
+    pthread_rwlock_unlock(&inode_locks[fileID]);
+    return sfs_endop(SFS_OP_FLUSH, start, res);
+}
+
+static void sfs_makescratchkey() {
+    pthread_key_create(&scratch_key, free);
+}
+
+/**
+ * Gets the scratch block of the calling thread, kept from call to call
+ * so that copying part of a block doesn't allocate
+ *
+ * @return BLOCK_SZ bytes, freed when the thread exits
+ */
+static char* sfs_scratchblock() {
+    pthread_once(&scratch_once, sfs_makescratchkey);
+
+    // the size comes first, a disk formatted with larger blocks needs a larger one
+    uint64_t* scratch = pthread_getspecific(scratch_key);
+    if (scratch == NULL || scratch[0] < BLOCK_SZ) {
+        free(scratch);
+        scratch = malloc(sizeof(uint64_t) + BLOCK_SZ);
+        scratch[0] = BLOCK_SZ;
+        pthread_setspecific(scratch_key, scratch);
+    }
+    return (char*) (scratch + 1);
+}
+
+/**
+ * Copies part of a block into a buffer. When the disk image is
+ * mapped the bytes are copied straight out of the mapping.
+ *
+ * @param block  the global block number
+ * @param offset the byte offset in the block
+ * @param dst    where the bytes are copied to
+ * @param length the number of bytes to copy
+ */
+static void sfs_readblock(unsigned int block, unsigned int offset, char* dst, unsigned int length) {
+    char* data = get_block_ptr(block);
+
+    SFS_STAT_ADD(bytes_copied, length);
+    if (data == NULL) {
+        char* local = sfs_scratchblock();
+        read_blocks(block, 1, local);
+        memcpy(dst, local + offset, length);
+        return;
+    }
+    memcpy(dst, data + offset, length);
+}
+
+/**
+ * Copies a buffer into part of a block. When the disk image is
+ * mapped the bytes are copied straight into the mapping. Otherwise
+ * the block is read, modified and written back, unless the rest of
+ * the block holds nothing worth keeping, in which case it is cleared
+ * and the read is skipped.
+ *
+ * @param block  the global block number
+ * @param offset the byte offset in the block
+ * @param src    the bytes to copy
+ * @param length the number of bytes to copy
+ * @param keep   whether the bytes of the block outside the copy must be kept
+ */
+static void sfs_writeblock(unsigned int block, unsigned int offset, const char* src, unsigned int length, int keep) {
+    char* local = NULL;
+    char* data = get_block_ptr(block);
+
+    SFS_STAT_ADD(bytes_copied, length);
+    if (data == NULL) {
+        data = local = sfs_scratchblock();
+        if (keep)
+            read_blocks(block, 1, local);
+    }
+    if (!keep) {
+        memset(data, 0, offset);
+        memset(data + offset + length, 0, BLOCK_SZ - offset - length);
+    }
+    memcpy(data + offset, src, length);
+    if (local != NULL)
+        write_blocks(block, 1, local);
+}
+
+/**
+ * Fills the end of a block with zeros, the bytes before it are kept
+ *
+ * @param block  the global block number
+ * @param offset the byte offset in the block the zeros start at, 0 for the whole block
+ */
+static void sfs_clearblock(unsigned int block, unsigned int offset) {
+    char* data = get_block_ptr(block);
+
+    if (data != NULL) {
+        memset(data + offset, 0, BLOCK_SZ - offset);
+        return;
+    }
+    data = sfs_scratchblock();
+    if (offset > 0)
+        read_blocks(block, 1, data);
+    memset(data + offset, 0, BLOCK_SZ - offset);
+    write_blocks(block, 1, data);
+}
+
+/**
+ * Loads an indirect pointer block into its slot of the indirect block
+ * cache, so walking the pointer tree of a large file doesn't cost a
+ * disk read per level. Indirect blocks are never changed in place,
+ * even when the disk image is mapped, they go through the journal
+ * like the rest of the metadata. The lock of the slot is held.
+ *
+ * @param  block the global block number of the indirect block
+ * @return       the pointers of the indirect block, valid until the slot is unlocked
+ */
+static unsigned int* sfs_loadindblock(unsigned int block) {
+    int slot = block % IND_CACHE_SIZE;
+    if (ind_cache_block[slot] != block) {
+        // hand the block held by the slot to the running transaction before reusing it
+        if (ind_cache_dirty[slot]) {
+            journal_add(ind_cache_block[slot], 1, IND_CACHE_SLOT(slot));
+            ind_cache_dirty[slot] = 0;
+        }
+        // the running transaction may hold a newer copy than the disk
+        if (!journal_read(block, IND_CACHE_SLOT(slot)))
+            read_blocks(block, 1, IND_CACHE_SLOT(slot));
+        ind_cache_block[slot] = block;
+    }
+    return IND_CACHE_SLOT(slot);
+}
+
+/**
+ * Copies pointers out of an indirect block
+ *
+ * @param  block the global block number of the indirect block
+ * @param  first the index of the first pointer
+ * @param  count the number of pointers, at most up to the end of the block
+ * @param  ptrs  the pointers are returned here
+ */
+static void sfs_getindptrs(unsigned int block, unsigned int first, unsigned int count, unsigned int* ptrs) {
+    int slot = block % IND_CACHE_SIZE;
+
+    pthread_mutex_lock(&ind_cache_lock[slot]);
+    memcpy(ptrs, sfs_loadindblock(block) + first, count * sizeof(unsigned int));
+    pthread_mutex_unlock(&ind_cache_lock[slot]);
+}
+
+/**
+ * Gets a pointer of an indirect block
+ *
+ * @param  block the global block number of the indirect block
+ * @param  index the index of the pointer in the block
+ * @return       the pointer
+ */
+static unsigned int sfs_getindptr(unsigned int block, unsigned int index) {
+    unsigned int ptr;
+
+    sfs_getindptrs(block, index, 1, &ptr);
+    return ptr;
+}
+
+/**
+ * Sets a pointer in an indirect block. The block is written on the
+ * next metadata flush, so that all the pointers set by one write
+ * cost a single block write.
+ *
+ * @param block the global block number of the indirect block
+ * @param index the index of the pointer in the block
+ * @param value the new pointer
+ */
+static void sfs_setindptr(unsigned int block, unsigned int index, unsigned int value) {
+    int slot = block % IND_CACHE_SIZE;
+
+    pthread_mutex_lock(&ind_cache_lock[slot]);
+    sfs_loadindblock(block)[index] = value;
+    ind_cache_dirty[slot] = 1;
+    pthread_mutex_unlock(&ind_cache_lock[slot]);
+}
+
+/**
+ * Starts a newly allocated indirect block with all its pointers cleared
+ *
+ * @param block the global block number of the indirect block
+ */
+static void sfs_initindblock(unsigned int block) {
+    // take over the slot without reading the block, it is written on the next flush
+    int slot = block % IND_CACHE_SIZE;
+    pthread_mutex_lock(&ind_cache_lock[slot]);
+    if (ind_cache_dirty[slot] && ind_cache_block[slot] != block)
+        journal_add(ind_cache_block[slot], 1, IND_CACHE_SLOT(slot));
+    ind_cache_block[slot] = block;
+    ind_cache_dirty[slot] = 1;
+    memset(IND_CACHE_SLOT(slot), 0, BLOCK_SZ);
+    pthread_mutex_unlock(&ind_cache_lock[slot]);
+}
+
+/**
+ * Allocates an indirect block with all its pointers cleared
+ *
+ * @param  ind_next the next block of a run already allocated for indirect
+ *                  blocks, moved past the one taken, NULL to allocate one
+ * @return          the global block number of the new block, 0 if the disk is full
+ */
+static unsigned int sfs_newindblock(unsigned int* ind_next) {
+    unsigned int block;
+
+    if (ind_next != NULL) {
+        block = (*ind_next)++;
+    } else {
+        block = get_index();
+        if (block == 0)
+            return 0;
+    }
+    sfs_initindblock(block);
+    return block;
+}
+
+/**
+ * Frees an indirect block and every block below it
+ *
+ * @param block  the global block number of the indirect block
+ * @param levels the levels of indirect blocks, counting this one
+ */
+static void sfs_freeindblock(unsigned int block, int levels) {
+    unsigned int* ptrs = malloc(BLOCK_SZ);
+
+    // copy the pointers, the cache slot may be reused below
+    sfs_getindptrs(block, 0, NUM_IND_PTRS, ptrs);
+    for (int i = 0; i < NUM_IND_PTRS; ++i)
+        if (ptrs[i] != 0 && ptrs[i] <= LAST_AVAILABLE_DATA_BLOCK) {
+            if (levels > 1)
+                sfs_freeindblock(ptrs[i], levels - 1);
+            else
+                journal_free(ptrs[i], 0);
+        }
+    free(ptrs);
+
+    int slot = block % IND_CACHE_SIZE;
+    pthread_mutex_lock(&ind_cache_lock[slot]);
+    if (ind_cache_block[slot] == block) {
+        ind_cache_block[slot] = 0;
+        ind_cache_dirty[slot] = 0;
+    }
+    pthread_mutex_unlock(&ind_cache_lock[slot]);
+    journal_free(block, 1);
+}
+
+/**
+ * Frees the blocks under an indirect block whose index in the file
+ * is past the blocks kept, and the indirect block too if none is kept
+ *
+ * @param  block  the global block number of the indirect block
+ * @param  levels the levels of indirect blocks, counting this one
+ * @param  base   the index in the file of the first block under it
+ * @param  keep   the number of blocks of the file kept
+ * @return        1 if the indirect block was freed, 0 otherwise
+ */
+static int sfs_freeindtail(unsigned int block, int levels, uint64_t base, uint64_t keep) {
+    uint64_t span = 1;      // blocks of the file under each pointer
+
+    for (int l = 1; l < levels; ++l)
+        span *= NUM_IND_PTRS;
+    if (base >= keep) {
+        sfs_freeindblock(block, levels);
+        return 1;
+    }
+    if (base + span * NUM_IND_PTRS <= keep)
+        return 0;
+
+    // only the pointers past the kept blocks change
+    unsigned int i = (keep - base) / span;
+    unsigned int* ptrs = malloc(BLOCK_SZ);
+    sfs_getindptrs(block, 0, NUM_IND_PTRS, ptrs);
+    for (; i < NUM_IND_PTRS; ++i) {
+        if (ptrs[i] == 0 || ptrs[i] > LAST_AVAILABLE_DATA_BLOCK)
+            continue;
+        if (levels > 1) {
+            if (sfs_freeindtail(ptrs[i], levels - 1, base + i * span, keep))
+                sfs_setindptr(block, i, 0);
+        } else if (base + i >= keep) {
+            journal_free(ptrs[i], 0);
+            sfs_setindptr(block, i, 0);
+        }
+    }
+    free(ptrs);
+    return 0;
+}
+
+/**
+ * Frees the blocks of a file past a given number of blocks, along
+ * with the indirect blocks left without any block. The caller marks
+ * the inode as dirty.
+ *
+ * @param n    the inode of the file
+ * @param keep the number of blocks of the file kept
+ */
+static void sfs_freetail(inode_t* n, uint64_t keep) {
+    unsigned int* roots[] = { &n->ind_ptr, &n->dbl_ind_ptr, &n->tpl_ind_ptr };
+    uint64_t base = NUM_DIR_PTRS;
+    uint64_t span = 1;
+
+    for (uint64_t j = keep; j < NUM_DIR_PTRS; ++j)
+        if (n->data_ptrs[j] != 0) {
+            journal_free(n->data_ptrs[j], 0);
+            n->data_ptrs[j] = 0;
+        }
+    for (int levels = 1; levels <= 3; ++levels) {
+        span *= NUM_IND_PTRS;
+        if (*roots[levels - 1] != 0 && sfs_freeindtail(*roots[levels - 1], levels, base, keep))
+            *roots[levels - 1] = 0;
+        base += span;
+    }
+}
+
+/**
+ * Finds where the pointer to a block of a file lives
+ *
+ * @param  n           the inode of the file
+ * @param  block_local the index of the block in the file
+ * @param  root        the inode field holding the pointer, or the root
+ *                     of the indirect blocks leading to it, is returned here
+ * @param  path        the index to follow in each level of indirect blocks is returned here
+ * @return             the number of levels of indirect blocks (0 for a direct pointer),
+ *                     -1 if the block is past the maximum file size
+ */
+static int sfs_ptrpath(inode_t* n, unsigned int block_local, unsigned int** root, unsigned int path[3]) {
+    uint64_t index = block_local;
+    uint64_t span = 1;
+
+    if (index < NUM_DIR_PTRS) {
+        *root = &n->data_ptrs[index];
+        return 0;
+    }
+    index -= NUM_DIR_PTRS;
+
+    unsigned int* roots[] = { &n->ind_ptr, &n->dbl_ind_ptr, &n->tpl_ind_ptr };
+    for (int levels = 1; levels <= 3; ++levels) {
+        span *= NUM_IND_PTRS;
+        if (index < span) {
+            *root = roots[levels - 1];
+            for (int i = levels - 1; i >= 0; --i) {
+                path[i] = index % NUM_IND_PTRS;
+                index /= NUM_IND_PTRS;
+            }
+            return levels;
+        }
+        index -= span;
+    }
+    return -1;
+}
+
+/**
+ * Gets the global index of a block of a file
+ *
+ * @param  n           the inode of the file
+ * @param  block_local the index of the block in the file
+ * @return             the global index, 0 if the block is not allocated
+ */
+static unsigned int sfs_getptr(inode_t* n, unsigned int block_local) {
+    unsigned int* root;
+    unsigned int path[3];
+
+    int levels = sfs_ptrpath(n, block_local, &root, path);
+    if (levels < 0)
+        return 0;
+
+    unsigned int block = *root;
+    for (int i = 0; i < levels && block != 0; ++i)
+        block = sfs_getindptr(block, path[i]);
+    return block;
+}
+
+/**
+ * Sets the global index of a block of a file, allocating the
+ * indirect blocks leading to it if needed. The caller marks the
+ * inode as dirty.
+ *
+ * @param  n           the inode of the file
+ * @param  block_local the index of the block in the file
+ * @param  value       the global index of the block
+ * @param  ind_next    where the indirect blocks are taken from, see sfs_newindblock
+ * @return             0 on success, -1 if past the maximum file size, -2 if the disk is full
+ */
+static int sfs_setptrfrom(inode_t* n, unsigned int block_local, unsigned int value, unsigned int* ind_next) {
+    unsigned int* root;
+    unsigned int path[3];
+
+    int levels = sfs_ptrpath(n, block_local, &root, path);
+    if (levels < 0)
         return -1;
+    if (levels == 0) {
+        *root = value;
+        return 0;
+    }
+
+    if (*root == 0 && (*root = sfs_newindblock(ind_next)) == 0)
+        return -2;
+
+    unsigned int block = *root;
+    for (int i = 0; i < levels - 1; ++i) {
+        unsigned int next = sfs_getindptr(block, path[i]);
+        if (next == 0) {
+            if ((next = sfs_newindblock(ind_next)) == 0)
+                return -2;
+            sfs_setindptr(block, path[i], next);
+        }
+        block = next;
+    }
+    sfs_setindptr(block, path[levels - 1], value);
+    return 0;
+}
+
+/**
+ * Sets the global index of a block of a file, see sfs_setptrfrom
+ *
+ * @return 0 on success, -1 if past the maximum file size, -2 if the disk is full
+ */
+static int sfs_setptr(inode_t* n, unsigned int block_local, unsigned int value) {
+    return sfs_setptrfrom(n, block_local, value, NULL);
+}
+
+/**
+ * Clears the pointer to a block of a file, and like sfs_freetail frees
+ * the indirect blocks leading to it that are left without any block.
+ * The block itself is freed by the caller, who marks the inode as dirty.
+ *
+ * @param n           the inode of the file
+ * @param block_local the index of the block in the file
+ */
+static void sfs_clearptr(inode_t* n, unsigned int block_local) {
+    unsigned int* root;
+    unsigned int path[3];
+    unsigned int chain[3];      // the indirect block of each level on the way
+
+    int levels = sfs_ptrpath(n, block_local, &root, path);
+    if (levels <= 0) {
+        if (levels == 0)
+            *root = 0;
+        return;
+    }
+
+    chain[0] = *root;
+    for (int l = 1; l < levels; ++l)
+        if (chain[l - 1] == 0 || (chain[l] = sfs_getindptr(chain[l - 1], path[l - 1])) == 0)
+            return;
+    sfs_setindptr(chain[levels - 1], path[levels - 1], 0);
+
+    // free the indirect blocks emptied, the deepest first
+    unsigned int* ptrs = (unsigned int*) sfs_scratchblock();
+    for (int l = levels - 1; l >= 0; --l) {
+        sfs_getindptrs(chain[l], 0, NUM_IND_PTRS, ptrs);
+        for (unsigned int i = 0; i < NUM_IND_PTRS; ++i)
+            if (ptrs[i] != 0)
+                return;
+        sfs_freeindblock(chain[l], 1);
+        if (l > 0)
+            sfs_setindptr(chain[l - 1], path[l - 1], 0);
+        else
+            *root = 0;
+    }
+}
 
-    // close the file
-    f->inode = 0;
+/**
+ * Gets the global indexes of a range of blocks of a file. Each
+ * indirect block on the way is loaded once for the whole range.
+ * A block that isn't allocated, a hole that reads as zeros when it
+ * is within the size of the file, is returned as 0.
+ *
+ * @param  n      the inode of the file
+ * @param  first  the index of the first block in the file
+ * @param  count  the number of blocks
+ * @param  blocks the global indexes are returned here
+ * @return        0 on success, -1 if the range goes past the maximum file size
+ */
+static int sfs_getblocks(inode_t* n, unsigned int first, unsigned int count, unsigned int* blocks) {
+    unsigned int* root;
+    unsigned int path[3];
+
+    for (unsigned int i = 0; i < count;) {
+        int levels = sfs_ptrpath(n, first + i, &root, path);
+        if (levels < 0)
+            return -1;
+
+        if (levels == 0) {
+            blocks[i++] = *root;
+            continue;
+        }
 
+        // walk down to the indirect block holding the pointer, then take
+        // every following pointer of the range from that same block
+        unsigned int j = path[levels - 1];
+        unsigned int len = NUM_IND_PTRS - j < count - i ? NUM_IND_PTRS - j : count - i;
+        unsigned int block = *root;
+        for (int l = 0; l < levels - 1 && block != 0; ++l)
+            block = sfs_getindptr(block, path[l]);
+        if (block != 0)
+            sfs_getindptrs(block, j, len, blocks + i);
+        else
+            memset(blocks + i, 0, len * sizeof(unsigned int));
+        i += len;
+    }
     return 0;
 }
 
 /**
- * Gets the block at the specified byte position
+ * Allocates the blocks of a range of a file that aren't allocated, the
+ * holes and those past the end of the file, as contiguous runs
+ * continuing right after the previous block of the file if possible.
+ * Blocks already allocated, or preallocated by sfs_fallocate, are kept.
+ *
+ * @param  n        the inode of the file
+ * @param  first    the index of the first block of the range in the file
+ * @param  count    the number of blocks of the range
+ * @param  blocks   the global indexes of the blocks of the range as
+ *                  sfs_getblocks returns them, the allocated ones are
+ *                  returned in place of the zeros
+ * @return          the number of blocks of the range allocated, less than count
+ *                  if the file system is full or the maximum file size is reached
+ */
+static unsigned int sfs_allocblocks(inode_t* n, unsigned int first, unsigned int count, unsigned int* blocks) {
+    unsigned int goal = first > 0 ? sfs_getptr(n, first - 1) + 1 : 0;
+    unsigned int run_next = 0;      // next block of the current run
+    unsigned int run_left = 0;      // blocks of the current run not used yet
+    int search = 1;                 // no search of the bit map came back short yet
+
+    for (unsigned int i = 0; i < count; ++i) {
+        // already allocated
+        if (blocks[i] != 0) {
+            goal = blocks[i] + 1;
+            continue;
+        }
+
+        if (run_left == 0) {
+            run_next = get_index_run(goal, count - i, search, &run_left);
+            if (run_left == 0) {
+                // file system full
+                count = i;
+                break;
+            }
+            // the map has no free run as long as the rest of the range,
+            // take the following free blocks from here on
+            if (run_next != goal && run_left < count - i)
+                search = 0;
+        }
+        if (sfs_setptr(n, first + i, run_next) != 0) {
+            // past the maximum file size or file system full
+            count = i;
+            break;
+        }
+        blocks[i] = run_next++;
+        goal = run_next;
+        --run_left;
+    }
+
+    // give back the blocks of a run that couldn't be used
+    while (run_left > 0) {
+        rm_index(run_next++);
+        --run_left;
+    }
+    return count;
+}
+
+/**
+ * Hands a run of physically contiguous blocks of a file to an extent
+ * callback. The disk file is brought up to date for the run first, and
+ * when fn writes the cached copies it made stale are dropped after.
+ * Nothing is moved if the cached changes can't be written back.
+ *
+ * @param  block   the global index of the first block of the run
+ * @param  nblocks the number of blocks of the run
+ * @param  offset  the byte offset of the extent in the run
+ * @param  length  the length of the extent in bytes
+ * @param  fn      the callback
+ * @param  arg     passed to fn
+ * @param  write   whether fn writes the extent
+ * @return         the number of bytes fn moved
+ */
+static int sfs_moveextent(unsigned int block, unsigned int nblocks, unsigned int offset, unsigned int length,
+                          sfs_extent_fn fn, void* arg, int write) {
+    sfs_extent_t extent;
+    char* mem = get_block_ptr(block);
+
+    extent.pos = (uint64_t) block * BLOCK_SZ + offset;
+    extent.length = length;
+    extent.mem = mem != NULL ? mem + offset : NULL;
+
+    // the disk file would be missing the cached changes, or have them dropped after a write
+    if (sync_blocks(block, nblocks) < 0)
+        return 0;
+    int moved = fn(arg, &extent);
+    if (write)
+        invalidate_blocks(block, nblocks);
+
+    if (moved < 0)
+        return 0;
+    return (unsigned int) moved > length ? (int) length : moved;
+}
+
+/**
+ * Hands the bytes of a hole of a file, zeros, to an extent callback,
+ * a block at a time
+ *
+ * @param  length the length of the hole in bytes
+ * @param  fn     the callback
+ * @param  arg    passed to fn
+ * @return        the number of bytes fn moved
+ */
+static int sfs_moveholes(unsigned int length, sfs_extent_fn fn, void* arg) {
+    sfs_extent_t extent;
+    unsigned int moved = 0;
+
+    extent.pos = 0;
+    extent.mem = sfs_scratchblock();
+    memset(extent.mem, 0, BLOCK_SZ);
+    while (moved < length) {
+        extent.length = length - moved < BLOCK_SZ ? length - moved : BLOCK_SZ;
+        int res = fn(arg, &extent);
+        if (res <= 0)
+            break;
+        moved += (unsigned int) res < extent.length ? (unsigned int) res : extent.length;
+        if ((unsigned int) res < extent.length)
+            break;
+    }
+    return moved;
+}
+
+/**
+ * Waits for the runs submitted by sfs_submitrun
+ *
+ * @param reqs  the requests
+ * @param nreqs the number of requests, reset to 0
+ */
+static void sfs_waitruns(disk_request* reqs, int* nreqs) {
+    for (int i = 0; i < *nreqs; ++i)
+        wait_io(&reqs[i]);
+    *nreqs = 0;
+}
+
+/**
+ * Reads or writes a run of whole blocks. While more of the file follows it
+ * goes to the disk asynchronously, so that the next runs and the metadata
+ * they need are handled while it is in flight. The last one, or any once
+ * IO_QUEUE_RUNS are in flight, runs right away in the calling thread.
+ *
+ * @param reqs   the requests in flight, waited for with sfs_waitruns
+ * @param nreqs  the number of requests in flight
+ * @param op     DISK_OP_READ or DISK_OP_WRITE
+ * @param block  the first block of the run
+ * @param nblocks the number of blocks
+ * @param mem    the memory read into or written from
+ * @param more   non-zero if more of the file follows the run
+ */
+static void sfs_submitrun(disk_request* reqs, int* nreqs, int op, unsigned int block,
+                          unsigned int nblocks, char* mem, int more) {
+    if (!more || *nreqs == IO_QUEUE_RUNS) {
+        if (op == DISK_OP_READ)
+            read_blocks(block, nblocks, mem);
+        else
+            write_blocks(block, nblocks, mem);
+        return;
+    }
+
+    disk_request* r = &reqs[(*nreqs)++];
+    r->op = op;
+    r->start_address = block;
+    r->nblocks = nblocks;
+    r->buffer = mem;
+    submit_io(r);
+}
+
+/**
+ * Starts reading ahead of a sequential reader, into the block cache. The
+ * window starts at RA_MIN_BLOCKS past the blocks read and doubles every
+ * time the reader gets halfway through what was read ahead, up to
+ * RA_MAX_BLOCKS or a quarter of the block cache. A read anywhere else
+ * resets it. The inode lock is held.
  *
- * @param  n            the inode for which to find the block
- * @param  location     the byte position in the file
- * @param  global_index the global index of the block is returned here
- * @param  local_index  the local index of the block (0-12+) is returned here
- * @return              0 on success
+ * @param fileID the file index in the file descriptor table
+ * @param pos    the byte position of the read
+ * @param length the number of bytes read, at least 1
  */
-int sfs_getblockatpointer(inode_t* n, uint64_t location, unsigned int* global_index, unsigned int* local_index) {
-    // check for invalid locations
-    if (location < 0 || location > n->size)
-        return -1;
-
-    int block_index = location / BLOCK_SZ;
-    if (block_index >= NUM_DIR_PTRS) {
-        // check if the index is valid
-        if (n->ind_ptr == 0)
-            return -2;
-
-        // file is larger than 12 blocks
-        block_index -= NUM_DIR_PTRS;
-        if (block_index > (NUM_IND_PTRS - 1))
-            // location points past the maximum file size
-            return -3;
-
-        // load the indirect pointer block
-        unsigned int ind_ptr_block[NUM_IND_PTRS];
-        read_blocks(n->ind_ptr, 1, ind_ptr_block);
-
-        // check if the index is valid
-        if (ind_ptr_block[block_index] == 0)
-            return -2;
-
-        *local_index = NUM_DIR_PTRS + block_index;
-        *global_index = ind_ptr_block[block_index];
+static void sfs_readahead(int fileID, uint64_t pos, unsigned int length) {
+    file_descriptor* f = &fdt[fileID];
+    inode_t* n = &table[fileID];
+    uint32_t last = (pos + length - 1) / BLOCK_SZ;
+    uint32_t nblocks = ((uint64_t) n->size + BLOCK_SZ - 1) / BLOCK_SZ;
+    uint32_t from = 0, to = 0;
+    uint32_t max_window = get_cache_size() / 4;
+
+    if (max_window > RA_MAX_BLOCKS)
+        max_window = RA_MAX_BLOCKS;
+    if (max_window < RA_MIN_BLOCKS)
+        // no cache to read into
+        return;
+
+    pthread_mutex_lock(&readahead_lock);
+    if (pos != f->ra_next) {
+        f->ra_window = 0;
+        f->ra_end = 0;
     } else {
-        // check if the index is valid
-        if (n->data_ptrs[block_index] == 0)
-            return -2;
-
-        *local_index = block_index;
-        *global_index = n->data_ptrs[block_index];
+        if (f->ra_window == 0) {
+            f->ra_window = RA_MIN_BLOCKS;
+            f->ra_end = last + 1;
+        }
+        if (last + f->ra_window / 2 >= f->ra_end) {
+            from = f->ra_end > last + 1 ? f->ra_end : last + 1;
+            to = last + 1 + f->ra_window;
+            if (to > nblocks)
+                to = nblocks;
+            if (f->ra_window * 2 <= max_window)
+                f->ra_window *= 2;
+        }
     }
-    return 0;
+    f->ra_next = pos + length;
+    pthread_mutex_unlock(&readahead_lock);
+
+    if (from >= to)
+        return;
+
+    unsigned int blocks[RA_MAX_BLOCKS];
+    if (sfs_getblocks(n, from, to - from, blocks) != 0)
+        return;
+
+    // stop at the first run the disk doesn't take, too large for the
+    // cache or the queue being full, and start again from there next time
+    uint32_t i = 0;
+    while (i < to - from) {
+        // nothing to read in a hole
+        if (blocks[i] == 0) {
+            ++i;
+            continue;
+        }
+        uint32_t run = 1;
+        while (i + run < to - from && blocks[i + run] == blocks[i] + run)
+            ++run;
+        uint32_t issued = prefetch_blocks(blocks[i], run);
+        i += issued;
+        if (issued < run)
+            break;
+    }
+
+    pthread_mutex_lock(&readahead_lock);
+    if (from + i > f->ra_end)
+        f->ra_end = from + i;
+    pthread_mutex_unlock(&readahead_lock);
 }
 
 /**
- * Read from a file
+ * Reads from a file at a position, the inode lock is held
  *
  * @param  fileID the file index in the file descriptor table
  * @param  buf    the buffer which will store what was read
  * @param  length the size of the content to be read in bytes
+ * @param  pos    the byte position to read at, moved past the bytes read
+ * @param  fn     if not NULL, called for each extent read instead of copying it into buf
+ * @param  arg    passed to fn
  * @return        the number of bytes read
  */
-int sfs_fread(int fileID, char *buf, int length) {
+static int sfs_readfile(int fileID, char *buf, int length, uint64_t* pos, sfs_extent_fn fn, void* arg) {
     // check the length
     if (length < 0)
         return -1;
@@ -281,91 +1821,152 @@ int sfs_fread(int fileID, char *buf, int length) {
     if (f->inode == 0)
         return -3;
 
-    // clamp the read length to avoid reading past the file size
-    if (length > (n->size - f->rwptr))
-        length = n->size - f->rwptr;
+    // clamp the read length to avoid reading past the file size, the
+    // buffered writes are copied over what is read from the disk
+    uint64_t size = sfs_filesize(fileID);
+    if (*pos >= size)
+        return 0;
+    if (length > (size - *pos))
+        length = size - *pos;
+
+    uint64_t start = *pos;
+    uint64_t end = *pos + length < n->size ? *pos + length : n->size;
+    if (end < start)
+        end = start;
+    unsigned int blocks[IO_BATCH_BLOCKS];
+    disk_request reqs[IO_QUEUE_RUNS];
+    int nreqs = 0;
+    int read_length = 0;
+
+    // the extents are handed out from the disk file, not the block cache
+    if (fn == NULL && length > 0)
+        sfs_readahead(fileID, *pos, length);
+
+    while (*pos < end) {
+        // resolve the next batch of blocks up front
+        unsigned int first = *pos / BLOCK_SZ;
+        unsigned int count = (end - 1) / BLOCK_SZ - first + 1;
+        if (count > IO_BATCH_BLOCKS)
+            count = IO_BATCH_BLOCKS;
+        if (sfs_getblocks(n, first, count, blocks) != 0) {
+            // missing block or trying to read past the maximum file size
+            sfs_waitruns(reqs, &nreqs);
+            return read_length > 0 ? read_length : -4;
+        }
 
-    unsigned int read_length = 0;
-    unsigned int block_global = 0;   // the global block number
-    unsigned int block_local = 0;    // the block index for this file
-    char block[BLOCK_SZ];
+        for (unsigned int i = 0; i < count;) {
+            // find the run of physically contiguous blocks starting here, or of holes
+            unsigned int run = 1;
+            while (i + run < count && (blocks[i] == 0 ? blocks[i + run] == 0 : blocks[i + run] == blocks[i] + run))
+                ++run;
+
+            uint64_t run_start = (uint64_t) (first + i) * BLOCK_SZ;
+            uint64_t run_end = run_start + (uint64_t) run * BLOCK_SZ;
+            if (run_end > end)
+                run_end = end;
+
+            unsigned int block = blocks[i];
+            unsigned int offset = *pos - run_start;
+
+            if (block == 0) {
+                // a hole reads as zeros
+                unsigned int length_local = run_end - *pos;
+                int moved = length_local;
+                if (fn != NULL)
+                    moved = sfs_moveholes(length_local, fn, arg);
+                else
+                    memset(buf + read_length, 0, length_local);
+                *pos += moved;
+                read_length += moved;
+                if (*pos < run_end)
+                    return read_length;
+                i += run;
+                continue;
+            }
 
-    // get the index of the required data block and load it
-    if (sfs_getblockatpointer(n, f->rwptr, &block_global, &block_local) != 0)
-        return -4;
-    read_blocks(block_global, 1, block);
-
-    // compute the number of additional blocks required for this read
-    unsigned int length_local = length;             // the length to be read in this block
-    unsigned int additional_required_blocks = 0;
-    unsigned int remaining_space = BLOCK_SZ - f->rwptr % BLOCK_SZ;
-    if (length > remaining_space) {
-        length_local = remaining_space;
-        additional_required_blocks += 1 + (length - remaining_space) / (BLOCK_SZ + 1);
-    }
-
-    // read the data from the current block
-    unsigned int local_rwptr = f->rwptr % BLOCK_SZ;
-    unsigned int buffer_index = 0;
-    for (buffer_index = 0; buffer_index < length_local; ++buffer_index, ++local_rwptr, ++f->rwptr, ++read_length)
-        buf[buffer_index] = block[local_rwptr];
-
-    // read additional blocks
-    int remaining_length = length;
-    for (int i = 0; i < additional_required_blocks; ++i) {
-        remaining_length -= length_local;
-
-        // load the next block to be read
-        ++block_local;
-        if (block_local < NUM_DIR_PTRS)
-            // next block to read is a direct block
-            block_global = n->data_ptrs[block_local];
-        else {
-            // next block to read is an indirect block
-            block_local -= NUM_DIR_PTRS;
-
-            if (block_local > (NUM_IND_PTRS - 1))
-                // trying to read past the maximum file size
-                return -5;
-
-            if (n->ind_ptr == 0)
-                // no indirect block pointer
-                return -6;
-
-            // load the indirect block
-            unsigned int ind_ptr_block[NUM_IND_PTRS];
-            read_blocks(n->ind_ptr, 1, ind_ptr_block);
-            block_global = ind_ptr_block[block_local];
-            block_local += NUM_DIR_PTRS;
-        }
+            if (fn != NULL) {
+                // hand over the whole run, once the disk file holds its latest contents
+                int moved = sfs_moveextent(block, run, offset, run_end - *pos, fn, arg, 0);
+                *pos += moved;
+                read_length += moved;
+                if (*pos < run_end)
+                    return read_length;
+                i += run;
+                continue;
+            }
 
-        read_blocks(block_global, 1, block);
+            // partial first block
+            if (offset != 0 || *pos + BLOCK_SZ > run_end) {
+                unsigned int length_local = BLOCK_SZ - offset;
+                if (*pos + length_local > run_end)
+                    length_local = run_end - *pos;
+                sfs_readblock(block, offset, buf + read_length, length_local);
+                *pos += length_local;
+                read_length += length_local;
+                ++block;
+            }
 
-        if (remaining_length > BLOCK_SZ)
-            length_local = BLOCK_SZ;
-        else
-            length_local = remaining_length;
+            // whole blocks, straight into the buffer in a single read
+            unsigned int whole_blocks = (run_end - *pos) / BLOCK_SZ;
+            if (whole_blocks > 0) {
+                sfs_submitrun(reqs, &nreqs, DISK_OP_READ, block, whole_blocks, buf + read_length, run_end < end);
+                *pos += (uint64_t) whole_blocks * BLOCK_SZ;
+                read_length += whole_blocks * BLOCK_SZ;
+                block += whole_blocks;
+            }
 
-        // read
-        for (int i = 0; i < length_local; ++i, ++buffer_index, ++f->rwptr, ++read_length)
-            buf[buffer_index] = block[i];
+            // partial last block
+            if (*pos < run_end) {
+                unsigned int length_local = run_end - *pos;
+                sfs_readblock(block, 0, buf + read_length, length_local);
+                *pos += length_local;
+                read_length += length_local;
+            }
+            i += run;
+        }
     }
+    sfs_waitruns(reqs, &nreqs);
+
+    // the rest comes from the buffer
+    write_buffer_t* b = &wbufs[fileID];
+    if (*pos == end)
+        read_length = length;
+    if (b->len > 0 && fn == NULL) {
+        uint64_t from = b->pos > start ? b->pos : start;
+        uint64_t to = b->pos + b->len < start + read_length ? b->pos + b->len : start + read_length;
+        if (from < to) {
+            memcpy(buf + (from - start), b->data + (from - b->pos), to - from);
+            SFS_STAT_ADD(bytes_copied, to - from);
+        }
+    }
+    *pos = start + read_length;
     return read_length;
 }
 
 /**
- * Write to a file
+ * Writes to a file at a position, the inode lock is held and the
+ * journal handle open. Past the end of the file, what is between
+ * the end and the position has to read as zeros already, see
+ * sfs_extendfile.
  *
  * @param  fileID the file index in the file descriptor table
  * @param  buf    the buffer containing the bytes to be written
  * @param  length the size of the content to be written in bytes
- * @return        the number of bytes written
+ * @param  pos    the byte position to write at, moved past the bytes written
+ * @param  fn     if not NULL, called for each extent written instead of copying it from buf
+ * @param  arg    passed to fn
+ * @return        the number of bytes written, -4 if the write would end past
+ *                the maximum file size
  */
-int sfs_fwrite(int fileID, const char *buf, int length) {
+static int sfs_writefile(int fileID, const char *buf, int length, uint64_t* pos, sfs_extent_fn fn, void* arg) {
     // check the write length
     if (length < 0)
         return -1;
 
+    // the size is kept in 32 bits, whatever the pointer tree can address
+    if (*pos > UINT32_MAX - (uint64_t) length)
+        return -4;
+
     // check if file exists
     if (root_directory[fileID].inode == 0)
         return -2;
@@ -377,94 +1978,308 @@ int sfs_fwrite(int fileID, const char *buf, int length) {
     if (f->inode == 0)
         return -3;
 
-    // load the required data block
-    unsigned int write_length = 0;
-    unsigned int block_global = 0;   // the global block number
-    unsigned int block_local = 0;    // the block index for this file
-    char block[BLOCK_SZ];
+    uint64_t end = *pos + length;
+    unsigned int blocks[IO_BATCH_BLOCKS];
+    uint8_t fresh[IO_BATCH_BLOCKS];     // whether each block was allocated by this write
+    disk_request reqs[IO_QUEUE_RUNS];
+    int nreqs = 0;
+    int write_length = 0;
+    int stopped = 0;
+
+    while (*pos < end && !stopped) {
+        unsigned int first = *pos / BLOCK_SZ;
+        unsigned int count = (end - 1) / BLOCK_SZ - first + 1;
+        if (count > IO_BATCH_BLOCKS)
+            count = IO_BATCH_BLOCKS;
+
+        // allocate the holes and the blocks past the end of the file,
+        // write what fits if the file system is full
+        if (sfs_getblocks(n, first, count, blocks) != 0)
+            break;
+        for (unsigned int k = 0; k < count; ++k)
+            fresh[k] = blocks[k] == 0;
+        count = sfs_allocblocks(n, first, count, blocks);
+        if (count == 0)
+            break;
 
-    // find its index and load the block
-    if (sfs_getblockatpointer(n, f->rwptr, &block_global, &block_local) != 0)
-        return -4;
-    read_blocks(block_global, 1, block);
-
-    // compute the number of additional blocks required for this write
-    unsigned int length_local = length;             // the length to be written in this block
-    unsigned int additional_required_blocks = 0;
-    unsigned int remaining_space = BLOCK_SZ - f->rwptr % BLOCK_SZ;
-    if (length > remaining_space) {
-        length_local = remaining_space;
-        additional_required_blocks += 1 + (length - remaining_space) / (BLOCK_SZ + 1);
-    }
-
-    // write the data to the block
-    unsigned int local_rwptr = f->rwptr % BLOCK_SZ;
-    unsigned int buffer_index = 0;
-    for (buffer_index = 0; buffer_index < length_local; ++buffer_index, ++local_rwptr, ++f->rwptr, ++n->size, ++write_length)
-        block[local_rwptr] = buf[buffer_index];
-    write_blocks(block_global, 1, block);
-
-    int remaining_length = length;
-    // write data to other blocks
-    for (int i = 0; i < additional_required_blocks; ++i) {
-        // calculate data size written to this block
-        remaining_length -= length_local;
-
-        // find a free block
-        unsigned int block_index = get_index();
-        if (block_index > LAST_AVAILABLE_DATA_BLOCK)
-            // file system full, abort write
-            return write_length;
-
-        ++block_local;
-        if (block_local < NUM_DIR_PTRS)
-            // direct pointer index
-            n->data_ptrs[block_local] = block_index;
-        else {
-            // indirect pointer index
-            block_local -= NUM_DIR_PTRS;
-
-            if (block_local > (NUM_IND_PTRS - 1))
-                // trying to write past the maximum file size
-                return write_length;
-
-            if (n->ind_ptr == 0) {
-                // create the indirect pointer block if it doesn't exist
-                n->ind_ptr = get_index();
-                if (n->ind_ptr > LAST_AVAILABLE_DATA_BLOCK)
-                    // file system full, abort write
-                    return write_length;
+        // write the batch, one run of physically contiguous blocks at a time
+        uint64_t batch_end = (uint64_t) (first + count) * BLOCK_SZ;
+        if (batch_end > end)
+            batch_end = end;
+        for (unsigned int i = 0; i < count;) {
+            unsigned int run = 1;
+            while (i + run < count && blocks[i + run] == blocks[i] + run)
+                ++run;
+
+            uint64_t run_start = (uint64_t) (first + i) * BLOCK_SZ;
+            uint64_t run_end = run_start + (uint64_t) run * BLOCK_SZ;
+            if (run_end > batch_end)
+                run_end = batch_end;
+
+            unsigned int block = blocks[i];
+            unsigned int last = (run_end - 1) / BLOCK_SZ - first;
+
+            if (fn != NULL) {
+                // a new block fn only fills part of reads as zeros around it
+                if (fresh[i] && *pos > run_start)
+                    sfs_clearblock(block, 0);
+                if (fresh[last] && run_end % BLOCK_SZ != 0 && n->size > run_end && (last != i || *pos == run_start))
+                    sfs_clearblock(blocks[last], 0);
+
+                // let fn fill the whole run, then drop the cached copies it made stale
+                unsigned int length_local = run_end - *pos;
+                int moved = sfs_moveextent(block, run, *pos - run_start, length_local, fn, arg, 1);
+                *pos += moved;
+                write_length += moved;
+                if ((unsigned int) moved < length_local) {
+                    stopped = 1;
+                    break;
+                }
+                i += run;
+                continue;
             }
 
-            // load the indirect block
-            unsigned int ind_ptr_block[NUM_IND_PTRS];
-            read_blocks(n->ind_ptr, 1, ind_ptr_block);
+            // partial first block, keep the rest if it holds file data
+            unsigned int offset = *pos - run_start;
+            if (offset != 0 || *pos + BLOCK_SZ > run_end) {
+                unsigned int length_local = BLOCK_SZ - offset;
+                if (*pos + length_local > run_end)
+                    length_local = run_end - *pos;
+                uint64_t block_start = *pos - offset;
+                int keep = !fresh[i] && ((offset > 0 && n->size > block_start) || n->size > *pos + length_local);
+                sfs_writeblock(block, offset, buf + write_length, length_local, keep);
+                *pos += length_local;
+                write_length += length_local;
+                ++block;
+            }
 
-            // add the block to the ind block ptr
-            ind_ptr_block[block_local] = block_index;
-            write_blocks(n->ind_ptr, 1, ind_ptr_block);
+            // whole blocks, straight from the buffer in a single write
+            unsigned int whole_blocks = (run_end - *pos) / BLOCK_SZ;
+            if (whole_blocks > 0) {
+                sfs_submitrun(reqs, &nreqs, DISK_OP_WRITE, block, whole_blocks, (char*) buf + write_length, run_end < end);
+                *pos += (uint64_t) whole_blocks * BLOCK_SZ;
+                write_length += whole_blocks * BLOCK_SZ;
+                block += whole_blocks;
+            }
 
-            block_local += NUM_DIR_PTRS;
+            // partial last block, keep the rest if it holds file data
+            if (*pos < run_end) {
+                unsigned int length_local = run_end - *pos;
+                sfs_writeblock(block, 0, buf + write_length, length_local, !fresh[last] && n->size > run_end);
+                *pos += length_local;
+                write_length += length_local;
+            }
+            i += run;
         }
 
-        // load the block
-        read_blocks(block_index, 1, block);
+        if (*pos > n->size)
+            n->size = *pos;
+
+        if (stopped)
+            // fn came up short, give back the new blocks it didn't reach,
+            // with the indirect blocks allocated for them, and clear the
+            // rest of the one it stopped in
+            for (unsigned int k = 0; k < count; ++k) {
+                uint64_t block_start = (uint64_t) (first + k) * BLOCK_SZ;
+                if (!fresh[k] || block_start + BLOCK_SZ <= *pos)
+                    continue;
+                if (block_start >= *pos) {
+                    sfs_clearptr(n, first + k);
+                    journal_free(blocks[k], 0);
+                } else if (n->size > *pos) {
+                    sfs_clearblock(blocks[k], *pos - block_start);
+                }
+            }
+    }
+
+    // update the inode table and the indirect blocks, then wait for the
+    // data still in flight, buf belongs to the caller once this returns
+    sfs_markinode(fileID);
+    sfs_waitruns(reqs, &nreqs);
 
-        if (remaining_length > BLOCK_SZ)
-            length_local = BLOCK_SZ;
-        else
-            length_local = remaining_length;
+    return write_length;
+}
 
-        // write
-        for (int i = 0; i < length_local; ++i, ++buffer_index, ++f->rwptr, ++n->size, ++write_length)
-            block[i] = buf[buffer_index];
-        write_blocks(block_index, 1, block);
+/**
+ * Counts the free blocks writing a range takes at most: the holes in it,
+ * the blocks past those of the file on disk, and the indirect blocks
+ * pointing to them
+ *
+ * @param  n     the inode of the file
+ * @param  start the start of the written range in bytes
+ * @param  end   the end of the written range in bytes
+ * @return       the number of blocks
+ */
+static uint32_t sfs_bufferblocks(inode_t* n, uint64_t start, uint64_t end) {
+    uint64_t allocated = ((uint64_t) n->size + BLOCK_SZ - 1) / BLOCK_SZ;
+    uint64_t first = start / BLOCK_SZ;
+    uint64_t last = (end + BLOCK_SZ - 1) / BLOCK_SZ;
+    unsigned int blocks[IO_BATCH_BLOCKS];
+    uint64_t count = 0;
+
+    for (uint64_t j = first; j < last && j < allocated;) {
+        unsigned int len = (last < allocated ? last : allocated) - j;
+        if (len > IO_BATCH_BLOCKS)
+            len = IO_BATCH_BLOCKS;
+        if (sfs_getblocks(n, j, len, blocks) != 0)
+            break;
+        for (unsigned int k = 0; k < len; ++k)
+            count += blocks[k] == 0;
+        j += len;
     }
+    if (last > allocated)
+        count += last - (first > allocated ? first : allocated);
+    if (count == 0)
+        return 0;
+    return count + count / NUM_IND_PTRS + 2;
+}
 
-    // update the inode table
-    write_blocks(1, sb.inode_table_len, table);
+/**
+ * Grows a file without writing its new bytes, which read as zeros: the
+ * rest of its last block and the blocks preallocated up to the new size
+ * are cleared, the others are left as holes. The inode lock is held and
+ * the journal handle open.
+ *
+ * @param  fileID the file index in the file descriptor table
+ * @param  size   the new size, larger than the current one
+ * @return        0 on success, -4 if the size is past the maximum file size
+ */
+static int sfs_extendfile(int fileID, uint64_t size) {
+    inode_t* n = &table[fileID];
+    unsigned int blocks[IO_BATCH_BLOCKS];
+    unsigned int* root;
+    unsigned int path[3];
 
-    return write_length;
+    // the last block has to be addressable by the inode
+    if (size > UINT32_MAX || sfs_ptrpath(n, (size - 1) / BLOCK_SZ, &root, path) < 0)
+        return -4;
+
+    for (uint64_t pos = n->size; pos < size;) {
+        unsigned int first = pos / BLOCK_SZ;
+        unsigned int count = (size - 1) / BLOCK_SZ - first + 1;
+        if (count > IO_BATCH_BLOCKS)
+            count = IO_BATCH_BLOCKS;
+        if (sfs_getblocks(n, first, count, blocks) != 0)
+            break;
+        for (unsigned int k = 0; k < count; ++k) {
+            uint64_t block_start = (uint64_t) (first + k) * BLOCK_SZ;
+            unsigned int offset = pos > block_start ? pos - block_start : 0;
+            if (blocks[k] != 0)
+                sfs_clearblock(blocks[k], offset);
+        }
+        pos = (uint64_t) (first + count) * BLOCK_SZ;
+    }
+
+    n->size = size;
+    sfs_markinode(fileID);
+    return 0;
+}
+
+/**
+ * Forgets the buffered writes of a file, the inode write lock is held
+ *
+ * @param fileID the file index in the file descriptor table
+ */
+static void sfs_dropbuffer(int fileID) {
+    write_buffer_t* b = &wbufs[fileID];
+
+    pthread_mutex_lock(&wb_lock);
+    wb_dirty -= b->len;
+    wb_reserved -= b->reserved;
+    pthread_mutex_unlock(&wb_lock);
+    b->len = 0;
+    b->reserved = 0;
+}
+
+/**
+ * Writes the buffered writes of a file as one range, so that the blocks
+ * past the end of the file are allocated together, in runs as contiguous
+ * as the free space allows. The inode write lock is held.
+ *
+ * @param  fileID the file index in the file descriptor table
+ * @return        0 on success, -5 if the file system filled up before the
+ *                buffered writes fit, what didn't fit is lost
+ */
+static int sfs_flushbuffer(int fileID) {
+    write_buffer_t* b = &wbufs[fileID];
+    if (b->len == 0)
+        return 0;
+
+    uint64_t pos = b->pos;
+    uint32_t len = b->len;
+    SFS_STAT_ADD(buffer_flushes, 1);
+    sfs_reserve(sfs_bufferblocks(&table[fileID], pos, pos + len));
+    journal_begin();
+    int res = sfs_writefile(fileID, b->data, len, &pos, NULL, NULL);
+    sfs_flushmetadata();
+
+    sfs_dropbuffer(fileID);
+    return res == (int) len ? 0 : -5;
+}
+
+/**
+ * Buffers a write if it starts within or right after the buffered range
+ * and the result fits WB_MAX_BYTES, writing the buffer first when the
+ * write continues it past that. Only writes that don't leave a gap past
+ * the end of the file are buffered, and only while enough free blocks
+ * are left to write all the buffered ranges and less than WB_DIRTY_BYTES
+ * are buffered altogether. The inode write lock is held.
+ *
+ * @param  fileID the file index in the file descriptor table
+ * @param  buf    the bytes to write
+ * @param  length the number of bytes
+ * @param  offset the byte position to write at
+ * @return        1 if the write was buffered, 0 if it has to be written
+ *                after the buffer, -5 if writing the buffer failed
+ */
+static int sfs_bufferwrite(int fileID, const char* buf, int length, uint64_t offset) {
+    write_buffer_t* b = &wbufs[fileID];
+    inode_t* n = &table[fileID];
+
+    if (length <= 0 || length >= WB_MAX_BYTES || fdt[fileID].inode == 0 || root_directory[fileID].inode == 0)
+        return 0;
+
+    if (b->len > 0 && (offset < b->pos || offset > b->pos + b->len || offset + length > b->pos + WB_MAX_BYTES)) {
+        // the buffer can't take it, start a new one if the write continues it
+        if (offset != b->pos + b->len)
+            return 0;
+        if (sfs_flushbuffer(fileID) < 0)
+            return -5;
+    }
+    uint64_t start = b->len > 0 ? b->pos : offset;
+    uint64_t end = offset + length > b->pos + b->len || b->len == 0 ? offset + length : b->pos + b->len;
+    if (b->len == 0 && offset > n->size)
+        return 0;
+
+    // the last block has to be addressable by the inode
+    unsigned int* root;
+    unsigned int path[3];
+    if (end > UINT32_MAX || sfs_ptrpath(n, (end - 1) / BLOCK_SZ, &root, path) < 0)
+        return 0;
+
+    // set aside the blocks it needs
+    uint32_t reserve = sfs_bufferblocks(n, start, end);
+    uint32_t free_blocks = get_free_count();
+    pthread_mutex_lock(&wb_lock);
+    int fits = wb_reserved - b->reserved + reserve <= free_blocks
+            && wb_dirty - b->len + (end - start) <= WB_DIRTY_BYTES;
+    if (fits) {
+        wb_reserved += reserve - b->reserved;
+        wb_dirty += end - start - b->len;
+    }
+    pthread_mutex_unlock(&wb_lock);
+    if (!fits)
+        return 0;
+
+    if (b->data == NULL)
+        b->data = malloc(WB_MAX_BYTES);
+    memcpy(b->data + (offset - start), buf, length);
+    SFS_STAT_ADD(bytes_copied, length);
+    SFS_STAT_ADD(buffered_writes, 1);
+    b->pos = start;
+    b->len = end - start;
+    b->reserved = reserve;
+    return 1;
 }
 
 /**
@@ -475,25 +2290,26 @@ int sfs_fwrite(int fileID, const char *buf, int length) {
  * @param  loc    the position in the file
  * @return        0 on success
  */
-int sfs_fseek(int fileID, int loc) {
-    // check if file exists
-    if (root_directory[fileID].inode == 0)
-        return -1;
+int sfs_fseek(int fileID, uint64_t loc) {
+    int res = 0;
 
+    pthread_rwlock_wrlock(&inode_locks[fileID]);
     file_descriptor* f = &fdt[fileID];
-    inode_t* n = &table[fileID];
-
-    // check if file is open
-    if (f->inode == 0)
-        return -2;
-
-    // check if the seek location is valid
-    if (loc < 0 || loc >= n->size)
-        return -3;
 
-    f->rwptr = loc;
-
-    return 0;
+    if (root_directory[fileID].inode == 0)
+        // check if file exists
+        res = -1;
+    else if (f->inode == 0)
+        // check if file is open
+        res = -2;
+    else if (loc >= sfs_filesize(fileID))
+        // check if the seek location is valid
+        res = -3;
+    else
+        f->rwptr = loc;
+
+    pthread_rwlock_unlock(&inode_locks[fileID]);
+    return res;
 }
 
 /**
@@ -503,29 +2319,635 @@ int sfs_fseek(int fileID, int loc) {
  * @return      0 on success, -1 on failure
  */
 int sfs_remove(char *file) {
+    uint64_t start = sfs_clock();
+
     // look for the file
-    for (int i = 1; i < NUM_INODES; ++i)
-        if (root_directory[i].inode != 0 && strcmp(root_directory[i].filename, file) == 0) {
-            // update the free bit map
-            inode_t* n = &table[i];
-            for (int i = 0; i < NUM_DIR_PTRS; ++i)
-                if (n->data_ptrs[i] != 0)
-                    rm_index(n->data_ptrs[i]);
-            if (n->ind_ptr != 0) {
-                unsigned int ind_ptr_block[NUM_IND_PTRS];
-                read_blocks(n->ind_ptr, 1, ind_ptr_block);
-                for (int i = 0; i < NUM_IND_PTRS; ++i)
-                    if (ind_ptr_block[i] != 0 && ind_ptr_block[i] <= LAST_AVAILABLE_DATA_BLOCK)
-                        rm_index(ind_ptr_block[i]);
+    pthread_rwlock_wrlock(&dir_lock);
+    int i = sfs_lookup(file);
+    if (i == -1) {
+        // file to remove not found
+        pthread_rwlock_unlock(&dir_lock);
+        return sfs_endop(SFS_OP_REMOVE, start, -1);
+    }
+    pthread_rwlock_wrlock(&inode_locks[i]);
+    journal_begin();
+
+    // the buffered writes go with the file
+    sfs_dropbuffer(i);
+    free(wbufs[i].data);
+    wbufs[i].data = NULL;
+
+    // update the free bit map and clear the inode
+    inode_t* n = &table[i];
+    sfs_freetail(n, 0);
+    n->size = 0;
+    sfs_markinode(i);
+
+    // remove file
+    sfs_unindexname(i);
+    root_directory[i].inode = 0;
+    fdt[i].inode = 0;
+    fdt[i].refs = 0;
+    ++fdt[i].gen;
+    sfs_markdirentry(i);
+    sfs_flushmetadata();
+
+    // the entry can be reused by the next create
+    free_entries[num_free_entries++] = i;
+
+    pthread_rwlock_unlock(&inode_locks[i]);
+    pthread_rwlock_unlock(&dir_lock);
+    return sfs_endop(SFS_OP_REMOVE, start, 0);
+}
+
+/**
+ * Read from a file
+ *
+ * @param  fileID the file index in the file descriptor table
+ * @param  buf    the buffer which will store what was read
+ * @param  length the size of the content to be read in bytes
+ * @return        the number of bytes read
+ */
+int sfs_fread(int fileID, char *buf, int length) {
+    uint64_t start = sfs_clock();
+
+    // the read moves the pointer of the descriptor, so it
+    // is locked like a write
+    pthread_rwlock_wrlock(&inode_locks[fileID]);
+    int res = sfs_readfile(fileID, buf, length, &fdt[fileID].rwptr, NULL, NULL);
+    pthread_rwlock_unlock(&inode_locks[fileID]);
+    return sfs_endop(SFS_OP_READ, start, res);
+}
+
+/**
+ * Write to a file. Small writes are buffered, see sfs_fflush.
+ *
+ * @param  fileID the file index in the file descriptor table
+ * @param  buf    the buffer containing the bytes to be written
+ * @param  length the size of the content to be written in bytes
+ * @return        the number of bytes written, -4 if the write would end past the
+ *                maximum file size, -5 if the file system filled up before the
+ *                writes buffered earlier fit
+ */
+int sfs_fwrite(int fileID, const char *buf, int length) {
+    uint64_t start = sfs_clock();
+
+    pthread_rwlock_wrlock(&inode_locks[fileID]);
+    int res = -4;
+    if (length <= 0 || fdt[fileID].rwptr <= UINT32_MAX - (uint64_t) length)
+        res = sfs_bufferwrite(fileID, buf, length, fdt[fileID].rwptr);
+    if (res == 1) {
+        fdt[fileID].rwptr += length;
+        res = length;
+    } else if (res == 0 && (res = sfs_flushbuffer(fileID)) == 0) {
+        // written in place, after what was buffered
+        sfs_reserve(sfs_bufferblocks(&table[fileID], fdt[fileID].rwptr, fdt[fileID].rwptr + length));
+        journal_begin();
+        res = sfs_writefile(fileID, buf, length, &fdt[fileID].rwptr, NULL, NULL);
+        sfs_flushmetadata();
+    }
+    pthread_rwlock_unlock(&inode_locks[fileID]);
+    return sfs_endop(SFS_OP_WRITE, start, res);
+}
+
+/**
+ * Read from a file at a position, without using or moving the
+ * read/write pointer. Reads of the same file run in parallel.
+ *
+ * @param  fileID the file index in the file descriptor table
+ * @param  buf    the buffer which will store what was read
+ * @param  length the size of the content to be read in bytes
+ * @param  offset the byte position to read at
+ * @return        the number of bytes read, 0 past the end of the file
+ */
+int sfs_pread(int fileID, char *buf, int length, uint64_t offset) {
+    uint64_t start = sfs_clock();
+
+    pthread_rwlock_rdlock(&inode_locks[fileID]);
+    int res = sfs_readfile(fileID, buf, length, &offset, NULL, NULL);
+    pthread_rwlock_unlock(&inode_locks[fileID]);
+    return sfs_endop(SFS_OP_READ, start, res);
+}
+
+/**
+ * Writes to a file at a position, leaving the gap as a hole
+ * when the position is past the end of the file. Small writes
+ * are buffered unless fn is given.
+ *
+ * @return the number of bytes written, -4 if the offset is past the maximum
+ *         file size, -5 if the file system filled up before the offset
+ */
+static int sfs_pwritefile(int fileID, const char *buf, int length, uint64_t offset, sfs_extent_fn fn, void* arg) {
+    if (length < 0)
+        return -1;
+    if (offset > UINT32_MAX - (uint64_t) length)
+        return -4;
+
+    pthread_rwlock_wrlock(&inode_locks[fileID]);
+    int res = fn == NULL ? sfs_bufferwrite(fileID, buf, length, offset) : 0;
+    if (res == 0)
+        res = sfs_flushbuffer(fileID);
+    if (res != 0) {
+        pthread_rwlock_unlock(&inode_locks[fileID]);
+        return res == 1 ? length : res;
+    }
+    sfs_reserve(sfs_bufferblocks(&table[fileID], offset, offset + length));
+    journal_begin();
+
+    // the gap is left as a hole
+    if (offset > table[fileID].size && fdt[fileID].inode != 0 && root_directory[fileID].inode != 0)
+        res = sfs_extendfile(fileID, offset);
+    if (res >= 0)
+        res = sfs_writefile(fileID, buf, length, &offset, fn, arg);
+
+    sfs_flushmetadata();
+    pthread_rwlock_unlock(&inode_locks[fileID]);
+    return res;
+}
+
+/**
+ * Write to a file at a position, without using or moving the
+ * read/write pointer. Writing past the end of the file leaves the
+ * gap as a hole that reads as zeros. Small writes are buffered, see
+ * sfs_fflush.
+ *
+ * @param  fileID the file index in the file descriptor table
+ * @param  buf    the buffer containing the bytes to be written
+ * @param  length the size of the content to be written in bytes
+ * @param  offset the byte position to write at
+ * @return        the number of bytes written, -4 if the offset is past the maximum
+ *                file size, -5 if the file system filled up before the offset
+ */
+int sfs_pwrite(int fileID, const char *buf, int length, uint64_t offset) {
+    uint64_t start = sfs_clock();
+    return sfs_endop(SFS_OP_WRITE, start, sfs_pwritefile(fileID, buf, length, offset, NULL, NULL));
+}
+
+/**
+ * Read from a file at a position like sfs_pread, except that the bytes
+ * are not copied: fn is called for each run of them that is contiguous
+ * on the disk image, in order, with the disk file holding their latest
+ * contents. It is meant for moving file data with the descriptor of the
+ * disk file (get_disk_fd). fn runs with the file locked and has to move
+ * the bytes before it returns: once the lock is dropped the blocks can
+ * be truncated, freed or moved and reused.
+ *
+ * @param  fileID the file index in the file descriptor table
+ * @param  length the number of bytes to read
+ * @param  offset the byte position to read at
+ * @param  fn     called for each extent, returns the number of bytes it moved,
+ *                the read stops at the first extent not moved entirely
+ * @param  arg    passed to fn
+ * @return        the number of bytes moved by fn, -5 if the file system
+ *                filled up before the buffered writes fit
+ */
+int sfs_preadextents(int fileID, int length, uint64_t offset, sfs_extent_fn fn, void* arg) {
+    uint64_t start = sfs_clock();
+
+    pthread_rwlock_rdlock(&inode_locks[fileID]);
+    if (wbufs[fileID].len > 0) {
+        // the extents are on the disk, write the buffer there first
+        pthread_rwlock_unlock(&inode_locks[fileID]);
+        pthread_rwlock_wrlock(&inode_locks[fileID]);
+        if (sfs_flushbuffer(fileID) < 0) {
+            pthread_rwlock_unlock(&inode_locks[fileID]);
+            return sfs_endop(SFS_OP_READ, start, -5);
+        }
+    }
+    int res = sfs_readfile(fileID, NULL, length, &offset, fn, arg);
+    pthread_rwlock_unlock(&inode_locks[fileID]);
+    return sfs_endop(SFS_OP_READ, start, res);
+}
+
+/**
+ * Write to a file at a position like sfs_pwrite, except that the blocks
+ * are allocated and fn fills them: it is called for each run of them
+ * that is contiguous on the disk image, in order, and writes the extent
+ * to the disk file (get_disk_fd) or to its mapping (extent->mem).
+ *
+ * @param  fileID the file index in the file descriptor table
+ * @param  length the number of bytes to write
+ * @param  offset the byte position to write at
+ * @param  fn     called for each extent, returns the number of bytes it wrote,
+ *                the write stops at the first extent not written entirely
+ * @param  arg    passed to fn
+ * @return        the number of bytes written by fn, -4 if the offset is past the maximum file size
+ */
+int sfs_pwriteextents(int fileID, int length, uint64_t offset, sfs_extent_fn fn, void* arg) {
+    uint64_t start = sfs_clock();
+    return sfs_endop(SFS_OP_WRITE, start, sfs_pwritefile(fileID, NULL, length, offset, fn, arg));
+}
+
+/**
+ * Truncate or extend a file to a given size. Shrinking frees the blocks
+ * past the new end, including preallocated ones. Extending only records
+ * the new size: the new part is a hole that reads as zeros, and the
+ * blocks preallocated for it, if any, are cleared.
+ *
+ * @param  fileID the file index in the file descriptor table
+ * @param  size   the new size in bytes
+ * @return        0 on success, -1 if the file is not open, -4 if the size is past
+ *                the maximum file size, -5 if the file system filled up
+ */
+int sfs_ftruncate(int fileID, uint64_t size) {
+    uint64_t start = sfs_clock();
+
+    pthread_rwlock_wrlock(&inode_locks[fileID]);
+    inode_t* n = &table[fileID];
+    if (fdt[fileID].inode == 0 || root_directory[fileID].inode == 0) {
+        pthread_rwlock_unlock(&inode_locks[fileID]);
+        return sfs_endop(SFS_OP_TRUNCATE, start, -1);
+    }
+    if (sfs_flushbuffer(fileID) < 0) {
+        pthread_rwlock_unlock(&inode_locks[fileID]);
+        return sfs_endop(SFS_OP_TRUNCATE, start, -5);
+    }
+
+    journal_begin();
+    if (size >= n->size) {
+        // the new bytes are a hole, nothing is allocated for them
+        int res = size > n->size ? sfs_extendfile(fileID, size) : 0;
+        sfs_flushmetadata();
+        pthread_rwlock_unlock(&inode_locks[fileID]);
+        return sfs_endop(SFS_OP_TRUNCATE, start, res);
+    }
+
+
+    // the first block stays, as it does in an empty file
+    uint64_t keep = (size + BLOCK_SZ - 1) / BLOCK_SZ;
+    sfs_freetail(n, keep > 0 ? keep : 1);
+    n->size = size;
+    if (fdt[fileID].rwptr > size)
+        fdt[fileID].rwptr = size;
+    sfs_markinode(fileID);
+
+    sfs_flushmetadata();
+    pthread_rwlock_unlock(&inode_locks[fileID]);
+    return sfs_endop(SFS_OP_TRUNCATE, start, 0);
+}
+
+/**
+ * Preallocate the blocks of a file up to a given size, in runs as
+ * contiguous as the free space allows, without changing the size of
+ * the file. The writes that later grow the file up to that size, or
+ * fill its holes, use them instead of allocating blocks.
+ *
+ * @param  fileID the file index in the file descriptor table
+ * @param  size   the size in bytes to preallocate for
+ * @return        0 on success, -1 if the file is not open, -4 if the size is past
+ *                the maximum file size, -5 if the file system filled up
+ */
+int sfs_fallocate(int fileID, uint64_t size) {
+    uint64_t start = sfs_clock();
+
+    if (size > UINT32_MAX)
+        return sfs_endop(SFS_OP_FALLOCATE, start, -4);
+
+    pthread_rwlock_wrlock(&inode_locks[fileID]);
+    inode_t* n = &table[fileID];
+    if (fdt[fileID].inode == 0 || root_directory[fileID].inode == 0) {
+        pthread_rwlock_unlock(&inode_locks[fileID]);
+        return sfs_endop(SFS_OP_FALLOCATE, start, -1);
+    }
+    // the buffered writes may end past the size on disk
+    if (sfs_flushbuffer(fileID) < 0) {
+        pthread_rwlock_unlock(&inode_locks[fileID]);
+        return sfs_endop(SFS_OP_FALLOCATE, start, -5);
+    }
+    sfs_reserve(sfs_bufferblocks(n, 0, size));
+    journal_begin();
+
+    int res = 0;
+    unsigned int blocks[IO_BATCH_BLOCKS];
+    unsigned int* root;
+    unsigned int path[3];
+    uint64_t end = (size + BLOCK_SZ - 1) / BLOCK_SZ;
+    uint64_t allocated = ((uint64_t) n->size + BLOCK_SZ - 1) / BLOCK_SZ;
+
+    // fill the holes too, a block taken for one within the file is cleared
+    for (uint64_t first = 0; first < end && res == 0;) {
+        unsigned int count = end - first < IO_BATCH_BLOCKS ? end - first : IO_BATCH_BLOCKS;
+        if (sfs_getblocks(n, first, count, blocks) != 0) {
+            res = -4;
+            break;
+        }
+        uint8_t fresh[IO_BATCH_BLOCKS];
+        for (unsigned int k = 0; k < count; ++k)
+            fresh[k] = blocks[k] == 0 && first + k < allocated;
+        unsigned int done = sfs_allocblocks(n, first, count, blocks);
+        for (unsigned int k = 0; k < done; ++k)
+            if (fresh[k])
+                sfs_clearblock(blocks[k], 0);
+        if (done < count)
+            res = sfs_ptrpath(n, first + done, &root, path) < 0 ? -4 : -5;
+        first += done;
+    }
+    sfs_markinode(fileID);
+
+    sfs_flushmetadata();
+    pthread_rwlock_unlock(&inode_locks[fileID]);
+    return sfs_endop(SFS_OP_FALLOCATE, start, res);
+}
+
+/**
+ * Counts the data blocks of a file, the ones preallocated past its end included
+ *
+ * @param  n the inode of the file
+ * @return   the number of blocks
+ */
+static unsigned int sfs_countblocks(inode_t* n) {
+    uint64_t count = ((uint64_t) n->size + BLOCK_SZ - 1) / BLOCK_SZ;
+
+    // the first block stays, as it does in an empty file
+    if (count == 0)
+        count = 1;
+    while (count < UINT32_MAX && sfs_getptr(n, count) != 0)
+        ++count;
+    return count;
+}
+
+/**
+ * Counts the indirect blocks pointing to the first blocks of a file
+ *
+ * @param  blocks the number of blocks of the file
+ * @return        the number of indirect blocks
+ */
+static unsigned int sfs_countindblocks(uint64_t blocks) {
+    uint64_t base = NUM_DIR_PTRS;
+    uint64_t span = 1;
+    uint64_t count = 0;
+
+    for (int levels = 1; levels <= 3 && blocks > base; ++levels) {
+        span *= NUM_IND_PTRS;
+        uint64_t here = blocks - base < span ? blocks - base : span;
+
+        // one block per NUM_IND_PTRS pointers on each level below the root
+        uint64_t unit = 1;
+        for (int l = 0; l < levels; ++l) {
+            unit *= NUM_IND_PTRS;
+            count += (here + unit - 1) / unit;
+        }
+        base += span;
+    }
+    return count;
+}
+
+/**
+ * Measures how the blocks of a file are laid out, the inode lock is held
+ *
+ * @param n      the inode of the file
+ * @param layout the layout is returned here
+ */
+static void sfs_measure(inode_t* n, sfs_layout_t* layout) {
+    unsigned int blocks[IO_BATCH_BLOCKS];
+    unsigned int prev = 0;
+
+    memset(layout, 0, sizeof(sfs_layout_t));
+    uint32_t total = sfs_countblocks(n);
+    for (uint32_t first = 0; first < total;) {
+        unsigned int count = total - first < IO_BATCH_BLOCKS ? total - first : IO_BATCH_BLOCKS;
+        if (sfs_getblocks(n, first, count, blocks) < 0)
+            break;
+        for (unsigned int k = 0; k < count; ++k) {
+            if (blocks[k] == 0) {
+                ++layout->holes;
+                continue;
             }
+            if (first + k == 0)
+                layout->first = blocks[k];
+            if (prev == 0 || blocks[k] != prev + 1)
+                ++layout->extents;
+            prev = blocks[k];
+        }
+        first += count;
+        layout->blocks = first;
+    }
+    layout->ind_blocks = sfs_countindblocks(layout->blocks);
+}
 
-            // remove file
-            root_directory[i].inode = 0;
-            fdt[i].inode = 0;
+/**
+ * Gets the layout of a file on the disk
+ *
+ * @param  path   the file name
+ * @param  layout the layout is returned here
+ * @return        0 on success, -1 if the file was not found
+ */
+int sfs_layout(const char* path, sfs_layout_t* layout) {
+    pthread_rwlock_rdlock(&dir_lock);
+    int i = sfs_lookup(path);
+    if (i != -1) {
+        pthread_rwlock_rdlock(&inode_locks[i]);
+        sfs_measure(&table[i], layout);
+        pthread_rwlock_unlock(&inode_locks[i]);
+    }
+    pthread_rwlock_unlock(&dir_lock);
+    return i == -1 ? -1 : 0;
+}
 
+/**
+ * Moves a file into one run of free blocks, its data blocks followed by
+ * its indirect blocks. The data is copied before the pointers change,
+ * and the pointers change in one transaction that frees the old blocks,
+ * so a crash leaves either layout. A fragmented file goes to the first
+ * run that fits, one that isn't only moves to a run before its first
+ * block. The inode write lock is held.
+ *
+ * @param  i       the index of the file
+ * @param  compact whether a file that isn't fragmented is moved toward the start of the disk
+ * @return         1 if the file was moved, 0 if it was left in place, -2 on a disk
+ *                 error, -5 if writing its buffered writes failed
+ */
+static int sfs_relocate(int i, int compact) {
+    inode_t* n = &table[i];
+    sfs_layout_t layout;
+
+    // the buffered writes need their blocks first
+    if (sfs_flushbuffer(i) < 0)
+        return -5;
+    sfs_measure(n, &layout);
+    // a sparse file is left as it is, the copy would fill its holes
+    if (layout.blocks == 0 || layout.holes > 0 || (layout.extents <= 1 && !compact))
+        return 0;
+
+    // the move has to commit in one transaction: the new indirect blocks,
+    // the inode, the free bit map at worst and the revokes of the old
+    // indirect blocks. Too large for the journal, the file stays.
+    uint32_t logged = layout.ind_blocks + 1 + NUM_BITMAP_BLOCKS;
+    if (!journal_fits(logged, layout.ind_blocks)) {
+        journal_commit();
+        if (!journal_fits(logged, layout.ind_blocks))
             return 0;
+    }
+
+    uint32_t total = layout.blocks + layout.ind_blocks;
+    sfs_reserve(total);
+    journal_begin();
+    unsigned int start = get_index_fit(total, layout.extents > 1 ? NUM_BLOCKS : layout.first);
+    if (start == 0) {
+        journal_end();
+        return 0;
+    }
+
+    // copy the data, reading the old blocks in their runs
+    unsigned int chunk = DEFRAG_CHUNK_BYTES / BLOCK_SZ > 0 ? DEFRAG_CHUNK_BYTES / BLOCK_SZ : 1;
+    unsigned int* blocks = malloc(chunk * sizeof(unsigned int));
+    char* buf = malloc((size_t) chunk * BLOCK_SZ);
+    int res = 0;
+
+    for (uint32_t first = 0; first < layout.blocks && res == 0;) {
+        unsigned int count = layout.blocks - first < chunk ? layout.blocks - first : chunk;
+        if (sfs_getblocks(n, first, count, blocks) < 0)
+            res = -2;
+        for (unsigned int k = 0; k < count && res == 0;) {
+            unsigned int run = 1;
+            while (k + run < count && blocks[k + run] == blocks[k] + run)
+                ++run;
+            if (read_blocks(blocks[k], run, buf + (size_t) k * BLOCK_SZ) < 0)
+                res = -2;
+            k += run;
         }
+        if (res == 0 && write_blocks(start + first, count, buf) < 0)
+            res = -2;
+        first += count;
+    }
+    free(blocks);
+    free(buf);
+
+    if (res < 0) {
+        for (uint32_t j = 0; j < total; ++j)
+            rm_index(start + j);
+        journal_end();
+        return res;
+    }
 
-    // file to remove not found
-    return -1;
+    // build the pointers to the copy in a copy of the inode, so that the
+    // file keeps its blocks if that fails
+    inode_t moved = *n;
+    memset(moved.data_ptrs, 0, sizeof(moved.data_ptrs));
+    moved.ind_ptr = moved.dbl_ind_ptr = moved.tpl_ind_ptr = 0;
+    unsigned int ind_next = start + layout.blocks;
+    uint32_t set = 0;
+    while (set < layout.blocks && sfs_setptrfrom(&moved, set, start + set, &ind_next) == 0)
+        ++set;
+    if (set < layout.blocks) {
+        // drop the copy, the blocks it points to are reused once the
+        // transaction commits, the others right away
+        sfs_freetail(&moved, 0);
+        for (uint32_t j = set; j < layout.blocks; ++j)
+            rm_index(start + j);
+        while (ind_next < start + total)
+            rm_index(ind_next++);
+        journal_end();
+        return -2;
+    }
+    while (ind_next < start + total)
+        rm_index(ind_next++);
+
+    // then point the inode at it, the old blocks are reused once the transaction commits
+    sfs_freetail(n, 0);
+    memcpy(n->data_ptrs, moved.data_ptrs, sizeof(n->data_ptrs));
+    n->ind_ptr = moved.ind_ptr;
+    n->dbl_ind_ptr = moved.dbl_ind_ptr;
+    n->tpl_ind_ptr = moved.tpl_ind_ptr;
+    sfs_markinode(i);
+
+    sfs_flushmetadata();
+    return 1;
+}
+
+/**
+ * Makes the blocks of a file contiguous if they aren't. Other
+ * operations on the file wait until it is done.
+ *
+ * @param  path    the file name
+ * @param  compact whether to also move the file toward the start of the disk
+ *                 if a large enough run of free blocks is there
+ * @return         1 if the file was moved, 0 if it was left in place, -1 if the
+ *                 file was not found, -2 on a disk error, -5 if writing its
+ *                 buffered writes failed
+ */
+int sfs_defrag(const char* path, int compact) {
+    pthread_rwlock_rdlock(&dir_lock);
+    int i = sfs_lookup(path);
+    if (i == -1) {
+        pthread_rwlock_unlock(&dir_lock);
+        return -1;
+    }
+    pthread_rwlock_wrlock(&inode_locks[i]);
+    // the file can't be removed while its inode is locked, let the other files be opened meanwhile
+    pthread_rwlock_unlock(&dir_lock);
+
+    int res = sfs_relocate(i, compact);
+    pthread_rwlock_unlock(&inode_locks[i]);
+    return res;
+}
+
+// a file to defragment, see sfs_defragall
+typedef struct {
+    uint32_t first;     // the global index of its first block
+    uint32_t index;     // its index in the root directory
+    uint32_t gen;       // the generation of its entry, changes when the file is removed
+} sfs_defragentry_t;
+
+static int sfs_comparefirst(const void* a, const void* b) {
+    uint32_t x = ((const sfs_defragentry_t*) a)->first;
+    uint32_t y = ((const sfs_defragentry_t*) b)->first;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Defragments every file, in the order of their first block on the disk
+ * so that with compaction the files slide toward the start of the disk
+ * and the free space gathers at its end. Files created meanwhile are
+ * left alone.
+ *
+ * @param  compact whether to move the files that aren't fragmented too, see sfs_defrag
+ * @param  stop    checked before each file, a nonzero result stops the pass, can be NULL
+ * @param  arg     passed to stop
+ * @return         the number of files moved, -2 on a disk error
+ */
+int sfs_defragall(int compact, int (*stop)(void*), void* arg) {
+    sfs_defragentry_t* files = malloc(NUM_INODES * sizeof(sfs_defragentry_t));
+    uint32_t nfiles = 0;
+    sfs_layout_t layout;
+    int moved = 0;
+
+    pthread_rwlock_rdlock(&dir_lock);
+    for (uint32_t i = 1; i < NUM_INODES; ++i) {
+        if (root_directory[i].inode == 0)
+            continue;
+        pthread_rwlock_rdlock(&inode_locks[i]);
+        sfs_measure(&table[i], &layout);
+        files[nfiles].first = layout.first;
+        files[nfiles].index = i;
+        files[nfiles].gen = fdt[i].gen;
+        ++nfiles;
+        pthread_rwlock_unlock(&inode_locks[i]);
+    }
+    pthread_rwlock_unlock(&dir_lock);
+    qsort(files, nfiles, sizeof(sfs_defragentry_t), sfs_comparefirst);
+
+    for (uint32_t k = 0; k < nfiles && moved >= 0; ++k) {
+        if (stop != NULL && stop(arg))
+            break;
+
+        uint32_t i = files[k].index;
+        pthread_rwlock_rdlock(&dir_lock);
+        pthread_rwlock_wrlock(&inode_locks[i]);
+        pthread_rwlock_unlock(&dir_lock);
+        if (root_directory[i].inode != 0 && fdt[i].gen == files[k].gen) {
+            int res = sfs_relocate(i, compact);
+            if (res == -2)
+                moved = -2;
+            else if (res > 0)
+                ++moved;
+        }
+        pthread_rwlock_unlock(&inode_locks[i]);
+
+        // the blocks the file left are free for the next ones once committed
+        if (journal_pending_frees() > 0)
+            journal_commit();
+    }
+    free(files);
+    return moved;
 }
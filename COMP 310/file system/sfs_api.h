@@ -3,17 +3,16 @@
 
 #include <stdint.h>
 
-#define NUM_BLOCKS 10000
+// geometry used by mksfs(1), mksfs_geometry formats with any other
+#define DEFAULT_BLOCK_SZ 1024
+#define DEFAULT_NUM_BLOCKS 10000
+#define DEFAULT_NUM_INODES 1024
 
 #define MAXFILENAME 20
 #define MAXEXTENSION 3
 
 #define NUM_DIR_PTRS 12
 
-// Size of the free bit map
-#define SIZE (NUM_BLOCKS / 8)
-
-extern uint8_t free_bit_map[SIZE];
 
 typedef struct {
     uint64_t inode;
@@ -26,6 +25,10 @@ typedef struct {
     uint64_t fs_size;
     uint64_t inode_table_len;
     uint64_t root_dir_inode;
+    uint64_t num_inodes;        // entries in the inode table and the root directory
+    uint64_t root_dir_len;      // blocks of the root directory
+    uint64_t bitmap_len;        // blocks of the free bit map
+    uint64_t journal_len;       // blocks of the metadata journal
     dir_entry_t root_dir_table[];
 } superblock_t;
 
@@ -36,7 +39,9 @@ typedef struct {
     unsigned int gid;
     unsigned int size;
     unsigned int data_ptrs[NUM_DIR_PTRS];
-    unsigned int ind_ptr;
+    unsigned int ind_ptr;       // block of pointers to data blocks
+    unsigned int dbl_ind_ptr;   // block of pointers to indirect blocks
+    unsigned int tpl_ind_ptr;   // block of pointers to double indirect blocks
 } inode_t;
 
 /**
@@ -44,12 +49,81 @@ typedef struct {
  * 
  * inode    which inode this entry describes
  * rwptr    the read/write pointer
+ * refs     the number of opens sharing this entry, see sfs_fopenshared
+ * gen      changes every time the file is removed
+ * ra_next  where a sequential read would start next
+ * ra_window the number of blocks read ahead next, 0 while reads aren't sequential
+ * ra_end   the file block up to which reads were started ahead
  */
 typedef struct {
     uint64_t inode;
     uint64_t rwptr;
+    uint32_t refs;
+    uint32_t gen;
+    uint64_t ra_next;
+    uint32_t ra_window;
+    uint32_t ra_end;
 } file_descriptor;
 
+/**
+ * The attributes of a file, see sfs_stat and sfs_getnextentry
+ *
+ * inode        the inode of the file
+ * size         the size of the file in bytes
+ * block_size   the size of the blocks holding it
+ */
+typedef struct {
+    uint32_t inode;
+    uint32_t block_size;
+    uint64_t size;
+} sfs_stat_t;
+
+/**
+ * A run of bytes of a file that is contiguous on the disk image
+ *
+ * pos      the byte position of the run on the disk image, 0 for a hole of
+ *          the file, whose zeros are at mem
+ * length   the length of the run in bytes
+ * mem      the run in the mapping of the disk image, NULL if it isn't mapped
+ */
+typedef struct {
+    uint64_t pos;
+    uint32_t length;
+    void* mem;
+} sfs_extent_t;
+
+/**
+ * Moves the bytes of an extent, see sfs_preadextents and sfs_pwriteextents
+ *
+ * @return the number of bytes moved
+ */
+typedef int (*sfs_extent_fn)(void* arg, const sfs_extent_t* extent);
+
+/**
+ * Sets up an in-memory free bit map with every block free
+ *
+ * @param num_blocks    the number of blocks on the disk
+ * @param start         the first disk block the bit map is stored in
+ * @param block_size    the size of a disk block in bytes
+ */
+void init_bitmap(uint32_t num_blocks, uint32_t start, uint32_t block_size);
+
+/**
+ * Reads the free bit map from the disk
+ */
+void load_bitmap();
+
+/**
+ * Adds the blocks of the free bit map changed since the last flush
+ * to the running journal transaction
+ */
+void flush_bitmap();
+
+/**
+ * @return the number of free blocks
+ */
+uint32_t get_free_count();
+
 /**
  * Marks an index in the free bit map as used
  *
@@ -65,21 +139,289 @@ void force_set_index(uint32_t index);
 void rm_index(uint32_t index);
 
 /**
- * Find the index of the first free data block
- * and mark it as used
+ * Find the index of a free data block, searching from where
+ * the last allocation ended, and mark it as used
  * 
- * @return the index
+ * @return the index, 0 if the disk is full
  */
 uint32_t get_index();
 
+/**
+ * Marks a run of contiguous free data blocks as used. The run starts
+ * at the goal block if it is free, so that a file growing block after
+ * block stays contiguous, otherwise at the first free run of the
+ * requested length after the last allocation (or the longest free
+ * run found if there is none). Without search the run starts at the
+ * first free block after the goal instead, which a caller asks for
+ * once a search came back short so that one request scans the map
+ * at most once.
+ *
+ * @param goal      the preferred first block
+ * @param count     the number of blocks wanted
+ * @param search    whether to search the map for a run of count blocks
+ * @param len       the number of blocks actually allocated (at most count,
+ *                  0 if the disk is full) is returned here
+ * @return the index of the first block of the run
+ */
+uint32_t get_index_run(uint32_t goal, uint32_t count, int search, uint32_t* len);
+
+/**
+ * Marks the run of contiguous free blocks closest to the start of the
+ * disk as used, so that the files moved into such runs pack the used
+ * blocks together
+ *
+ * @param count     the length of the run
+ * @param limit     the run must end at or before this block
+ * @return the index of the first block of the run, 0 if there is none
+ */
+uint32_t get_index_fit(uint32_t count, uint32_t limit);
+
+/**
+ * Measures how scattered the free space is
+ *
+ * @param extents   the number of runs of contiguous free blocks is returned here
+ * @param largest   the length of the longest one is returned here
+ */
+void get_free_extents(uint32_t* extents, uint32_t* largest);
+
+/**
+ * Allocator activity since the disk was mounted
+ *
+ * allocations  calls to get_index and get_index_run that found free blocks
+ * blocks       blocks allocated by them
+ * scans        allocations that searched the bit map, the goal block being used
+ * runs         free runs examined by those searches
+ */
+typedef struct {
+    unsigned long allocations;
+    unsigned long blocks;
+    unsigned long scans;
+    unsigned long runs;
+} alloc_stats_t;
+
+void get_alloc_stats(alloc_stats_t* stats);
+void reset_alloc_stats();
+
+/**
+ * Journal activity since the disk was mounted
+ *
+ * commits          transactions written to the journal
+ * blocks           metadata blocks written by those transactions
+ * journal_writes   journal blocks written, descriptors and commit blocks included
+ * checkpoints      times the journal was emptied
+ * overflows        transactions too large for the journal, written in place
+ */
+typedef struct {
+    unsigned long commits;
+    unsigned long blocks;
+    unsigned long journal_writes;
+    unsigned long checkpoints;
+    unsigned long overflows;
+} journal_stats_t;
+
+/**
+ * Sets up an empty in-memory journal
+ *
+ * @param start         the first disk block of the journal
+ * @param nblocks       the number of blocks of the journal
+ * @param block_size    the size of a disk block in bytes
+ */
+void init_journal(uint32_t start, uint32_t nblocks, uint32_t block_size);
+
+/**
+ * Writes an empty journal to the disk
+ */
+void format_journal();
+
+/**
+ * Applies the transactions committed to the journal but not checkpointed
+ * to their home locations and empties the journal
+ *
+ * @return the number of transactions replayed, -1 if there is no journal on the disk,
+ *         -2 if memory ran out, nothing was replayed then
+ */
+int replay_journal();
+
+/**
+ * Marks the start of an operation changing metadata. A commit waits
+ * for the operations that started to end, and new ones wait for it.
+ * Called after taking the file system locks the operation needs.
+ */
+void journal_begin();
+
+/**
+ * Marks the end of an operation started with journal_begin
+ */
+void journal_end();
+
+/**
+ * Keeps other threads from changing the running transaction
+ * or committing it until unlock_journal. Can be nested.
+ */
+void lock_journal();
+void unlock_journal();
+
+/**
+ * Adds metadata blocks to the running transaction. They are written to
+ * the journal on the next commit and to their home location after that.
+ *
+ * @param block     the home location of the first block
+ * @param nblocks   the number of blocks
+ * @param data      the new contents of the blocks
+ */
+void journal_add(uint32_t block, uint32_t nblocks, const void* data);
+
+/**
+ * Gets the contents of a block from the running transaction, which are
+ * newer than the ones on the disk
+ *
+ * @param block     the home location of the block
+ * @param data      where the block is copied to
+ * @return 1 if the block is part of the running transaction, 0 otherwise
+ */
+int journal_read(uint32_t block, void* data);
+
+/**
+ * Frees a block when the running transaction commits, so that it
+ * isn't reused before the change that freed it is on the disk
+ *
+ * @param block     the block to free
+ * @param revoke    1 if the block held metadata, which must then not
+ *                  be replayed from older transactions
+ */
+void journal_free(uint32_t block, int revoke);
+
+/**
+ * @return the number of blocks waiting for the running transaction to commit to be freed
+ */
+uint32_t journal_pending_frees();
+
+/**
+ * @param  nblocks  blocks an operation will add to the running transaction
+ * @param  nrevokes metadata blocks it will free
+ * @return          1 if the running transaction still fits in the journal with
+ *                  them, 0 if it would have to be written in place, unprotected
+ */
+int journal_fits(uint32_t nblocks, uint32_t nrevokes);
+
+/**
+ * Tells whether the running transaction has grown or aged enough to be committed
+ *
+ * @param batch_blocks  commit once the transaction has this many blocks
+ * @param interval_ms   commit once the first change is this old
+ */
+int journal_commit_due(uint32_t batch_blocks, uint32_t interval_ms);
+
+/**
+ * Writes the running transaction to the journal in a single sequential
+ * write, then its blocks to their home locations
+ *
+ * @return 1 if a transaction was committed, 0 if there was nothing to commit
+ */
+int journal_commit();
+
+/**
+ * @return 1 if more than half of the journal holds transactions not checkpointed yet
+ */
+int journal_checkpoint_due();
+
+/**
+ * Makes the committed blocks durable at their home locations and empties the journal
+ */
+void journal_checkpoint();
+
+void get_journal_stats(journal_stats_t* stats);
+void reset_journal_stats();
+
+// the kinds of calls counted and timed in sfs_stats_t
+enum {
+    SFS_OP_OPEN,        // sfs_fopen, sfs_fopenshared
+    SFS_OP_CLOSE,       // sfs_fclose
+    SFS_OP_READ,        // sfs_fread, sfs_pread, sfs_preadextents
+    SFS_OP_WRITE,       // sfs_fwrite, sfs_pwrite, sfs_pwriteextents
+    SFS_OP_STAT,        // sfs_stat, sfs_getfilesize
+    SFS_OP_READDIR,     // sfs_getnextfilename, sfs_getnextentry
+    SFS_OP_REMOVE,      // sfs_remove
+    SFS_OP_TRUNCATE,    // sfs_ftruncate
+    SFS_OP_FALLOCATE,   // sfs_fallocate
+    SFS_OP_FLUSH,       // sfs_fflush
+    SFS_OP_SYNC,        // sfs_sync
+    SFS_NUM_OPS
+};
+
+/**
+ * File system activity since the disk was mounted, see sfs_getstats
+ *
+ * op_count         the calls of each SFS_OP_ kind
+ * op_ns            the time spent in them in nanoseconds
+ * bytes_read       bytes returned by reads
+ * bytes_written    bytes written
+ * bytes_copied     bytes copied by the file system itself rather than the
+ *                  block cache: parts of blocks and buffered writes
+ * lookups          file names looked up
+ * lookup_probes    slots of the name index examined by those lookups
+ * metadata_flushes operations that handed their metadata changes to the journal
+ * buffered_writes  writes kept in a write buffer, see sfs_fflush
+ * buffer_flushes   write buffers written to the disk
+ */
+typedef struct {
+    unsigned long op_count[SFS_NUM_OPS];
+    unsigned long op_ns[SFS_NUM_OPS];
+    unsigned long bytes_read;
+    unsigned long bytes_written;
+    unsigned long bytes_copied;
+    unsigned long lookups;
+    unsigned long lookup_probes;
+    unsigned long metadata_flushes;
+    unsigned long buffered_writes;
+    unsigned long buffer_flushes;
+} sfs_stats_t;
+
+/**
+ * How the blocks of a file are laid out on the disk, see sfs_layout
+ *
+ * blocks       data blocks, the ones preallocated past the end included
+ * extents      runs of physically contiguous data blocks, 1 if the file is not fragmented
+ * ind_blocks   indirect blocks pointing to them
+ * first        the global index of the first data block
+ * holes        blocks of the file not allocated, counted in blocks
+ */
+typedef struct {
+    uint32_t blocks;
+    uint32_t extents;
+    uint32_t ind_blocks;
+    uint32_t first;
+    uint32_t holes;
+} sfs_layout_t;
+
 void mksfs(int fresh);
+int mksfs_geometry(int block_size, uint64_t fs_size, int num_inodes);
+int sfs_reopen();
+int sfs_sync();
+void sfs_unmount();
+void sfs_getstats(sfs_stats_t* stats);
+void sfs_resetstats();
 int sfs_getnextfilename(char *fname);
-int sfs_getfilesize(const char* path);
+int sfs_getnextentry(uint32_t* pos, char *fname, sfs_stat_t* st);
+int64_t sfs_getfilesize(const char* path);
+int sfs_stat(const char* path, sfs_stat_t* st);
 int sfs_fopen(char *name);
+int sfs_fopenshared(char *name);
+uint32_t sfs_fgen(int fileID);
 int sfs_fclose(int fileID);
+int sfs_fflush(int fileID);
 int sfs_fread(int fileID, char *buf, int length);
 int sfs_fwrite(int fileID, const char *buf, int length);
-int sfs_fseek(int fileID, int loc);
+int sfs_pread(int fileID, char *buf, int length, uint64_t offset);
+int sfs_pwrite(int fileID, const char *buf, int length, uint64_t offset);
+int sfs_preadextents(int fileID, int length, uint64_t offset, sfs_extent_fn fn, void* arg);
+int sfs_pwriteextents(int fileID, int length, uint64_t offset, sfs_extent_fn fn, void* arg);
+int sfs_ftruncate(int fileID, uint64_t size);
+int sfs_fallocate(int fileID, uint64_t size);
+int sfs_fseek(int fileID, uint64_t loc);
 int sfs_remove(char *file);
+int sfs_layout(const char* path, sfs_layout_t* layout);
+int sfs_defrag(const char* path, int compact);
+int sfs_defragall(int compact, int (*stop)(void*), void* arg);
 
 #endif //_INCLUDE_SFS_API_H_
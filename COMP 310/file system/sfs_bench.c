@@ -0,0 +1,477 @@
+#include "sfs_api.h"
+#include "disk_emu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_BLOCK_SZ 1024
+#define BENCH_MAX_RECORD (1 << 20)      // the largest read or write of a run
+
+// what the command line sets, see usage
+typedef struct {
+    int backend;
+    int cache_blocks;
+    int io_threads;
+    long disk_mib;
+    long file_mib;
+    int num_files;
+    int ops;
+    unsigned int seed;
+    char* disk_model;   // see parse_disk_model, SFS_DISK_MODEL if NULL
+    char** only;        // the names of the workloads to run, all if none
+    int num_only;
+} bench_options_t;
+
+bench_options_t opts = {DISK_BACKEND_PIO, DEFAULT_CACHE_BLOCKS, DEFAULT_IO_THREADS, 256, 16, 1000, 2000, 1, NULL, NULL, 0};
+
+// one measured run of a workload
+typedef struct {
+    char name[32];
+    char param[32];
+    int ops;
+    uint64_t bytes;         // file data moved by the operations
+    double* latency_us;     // one per operation
+    double elapsed_us;      // from the first operation to the end of the final sync
+    struct timespec start;
+    struct timespec op_start;
+    cache_stats_t stats;
+} bench_run_t;
+
+char* data = NULL;          // BENCH_MAX_RECORD bytes written by the workloads
+char* scratch = NULL;       // BENCH_MAX_RECORD bytes read into
+
+static double elapsed_us(struct timespec* start) {
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e6 + (end.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Formats a fresh disk with the options of the command line
+ *
+ * @param  num_inodes the number of files the workload needs, at least
+ * @return            0 on success
+ */
+static int bench_format(int num_inodes) {
+    set_disk_backend(opts.backend);
+    set_cache_size(opts.cache_blocks);
+    set_io_threads(opts.io_threads);
+    return mksfs_geometry(BENCH_BLOCK_SZ, (uint64_t) opts.disk_mib << 20, num_inodes + 1);
+}
+
+/**
+ * Starts a run, the operations are timed between bench_opstart and bench_opend
+ *
+ * @param run   the run
+ * @param name  the workload
+ * @param param what it was run with
+ * @param ops   the number of operations it will time, at most
+ */
+static void bench_start(bench_run_t* run, const char* name, const char* param, int ops) {
+    snprintf(run->name, sizeof(run->name), "%s", name);
+    snprintf(run->param, sizeof(run->param), "%s", param);
+    run->ops = 0;
+    run->bytes = 0;
+    run->latency_us = malloc((ops > 0 ? ops : 1) * sizeof(double));
+    reset_cache_stats();
+    clock_gettime(CLOCK_MONOTONIC, &run->start);
+}
+
+static void bench_opstart(bench_run_t* run) {
+    clock_gettime(CLOCK_MONOTONIC, &run->op_start);
+}
+
+static void bench_opend(bench_run_t* run, uint64_t bytes) {
+    run->latency_us[run->ops++] = elapsed_us(&run->op_start);
+    run->bytes += bytes;
+}
+
+/**
+ * Ends a run, syncing first when it changed the disk, and prints it
+ *
+ * @param run  the run
+ * @param sync 1 to include an sfs_sync in the elapsed time
+ */
+static void bench_end(bench_run_t* run, int sync) {
+    if (sync)
+        sfs_sync();
+    run->elapsed_us = elapsed_us(&run->start);
+    get_cache_stats(&run->stats);
+
+    qsort(run->latency_us, run->ops, sizeof(double), compare_doubles);
+    int n = run->ops > 0 ? run->ops : 1;
+    double secs = run->elapsed_us / 1e6;
+    double p50 = run->ops > 0 ? run->latency_us[(run->ops - 1) / 2] : 0;
+    double p90 = run->ops > 0 ? run->latency_us[(int) ((run->ops - 1) * 0.90)] : 0;
+    double p99 = run->ops > 0 ? run->latency_us[(int) ((run->ops - 1) * 0.99)] : 0;
+    double max = run->ops > 0 ? run->latency_us[run->ops - 1] : 0;
+
+    printf("%-10s %-18s %8d %11.0f %9.2f %9.1f %9.1f %9.1f %10.1f %8.2f %8.2f %10.1f\n",
+           run->name, run->param, run->ops, run->ops / secs, run->bytes / secs / (1 << 20),
+           p50, p90, p99, max,
+           (double) run->stats.blocks_read / n, (double) run->stats.blocks_written / n,
+           run->stats.device_ns / 1e6);
+    fflush(stdout);
+    free(run->latency_us);
+}
+
+static void bench_header() {
+    printf("%-10s %-18s %8s %11s %9s %9s %9s %9s %10s %8s %8s %10s\n",
+           "workload", "param", "ops", "ops/s", "MB/s", "p50 us", "p90 us", "p99 us", "max us",
+           "blk rd", "blk wr", "device ms");
+}
+
+static int bench_selected(const char* name) {
+    if (opts.num_only == 0)
+        return 1;
+    for (int i = 0; i < opts.num_only; ++i)
+        if (strcmp(opts.only[i], name) == 0)
+            return 1;
+    return 0;
+}
+
+static void bench_filename(char* name, int i) {
+    snprintf(name, MAXFILENAME, "f%d", i);
+}
+
+static void size_param(char* param, size_t len, const char* what, uint64_t bytes) {
+    if (bytes >= (1 << 20))
+        snprintf(param, len, "%s=%lluM", what, (unsigned long long) (bytes >> 20));
+    else if (bytes >= 1024)
+        snprintf(param, len, "%s=%lluK", what, (unsigned long long) (bytes >> 10));
+    else
+        snprintf(param, len, "%s=%llu", what, (unsigned long long) bytes);
+}
+
+/**
+ * Creates files, then opens and closes them in random order
+ */
+static void bench_create_open(int num_files) {
+    bench_run_t run;
+    char name[MAXFILENAME];
+    char param[32];
+
+    if (!bench_selected("create") && !bench_selected("open") && !bench_selected("list")
+            && !bench_selected("remove"))
+        return;
+    if (bench_format(num_files) != 0)
+        return;
+    snprintf(param, sizeof(param), "files=%d", num_files);
+
+    if (bench_selected("create")) {
+        bench_start(&run, "create", param, num_files);
+        for (int i = 0; i < num_files; ++i) {
+            bench_filename(name, i);
+            bench_opstart(&run);
+            int fd = sfs_fopen(name);
+            sfs_fclose(fd);
+            bench_opend(&run, 0);
+        }
+        bench_end(&run, 1);
+    } else {
+        for (int i = 0; i < num_files; ++i) {
+            bench_filename(name, i);
+            sfs_fclose(sfs_fopen(name));
+        }
+    }
+
+    if (bench_selected("open")) {
+        bench_start(&run, "open", param, opts.ops);
+        for (int i = 0; i < opts.ops; ++i) {
+            bench_filename(name, rand() % num_files);
+            bench_opstart(&run);
+            int fd = sfs_fopen(name);
+            sfs_fclose(fd);
+            bench_opend(&run, 0);
+        }
+        bench_end(&run, 0);
+    }
+
+    if (bench_selected("list")) {
+        // one operation per entry returned
+        char fname[MAXFILENAME];
+        sfs_stat_t st;
+        uint32_t pos = 0;
+        bench_start(&run, "list", param, num_files + 1);
+        for (;;) {
+            bench_opstart(&run);
+            if (!sfs_getnextentry(&pos, fname, &st))
+                break;
+            bench_opend(&run, 0);
+        }
+        bench_end(&run, 0);
+    }
+
+    if (bench_selected("remove")) {
+        bench_start(&run, "remove", param, num_files);
+        for (int i = 0; i < num_files; ++i) {
+            bench_filename(name, i);
+            bench_opstart(&run);
+            sfs_remove(name);
+            bench_opend(&run, 0);
+        }
+        bench_end(&run, 1);
+    }
+    sfs_unmount();
+}
+
+/**
+ * Writes a file sequentially in records of a given size, reads it back
+ * sequentially, then reads and rewrites records at random positions
+ */
+static void bench_records(uint64_t file_size, int record) {
+    bench_run_t run;
+    char param[32];
+    int records = file_size / record;
+
+    if (!bench_selected("seqwrite") && !bench_selected("seqread") && !bench_selected("randread")
+            && !bench_selected("randwrite"))
+        return;
+    if (records == 0 || bench_format(1) != 0)
+        return;
+    size_param(param, sizeof(param), "rec", record);
+
+    int fd = sfs_fopen("records");
+    if (bench_selected("seqwrite")) {
+        bench_start(&run, "seqwrite", param, records);
+        for (int i = 0; i < records; ++i) {
+            bench_opstart(&run);
+            sfs_pwrite(fd, data, record, (uint64_t) i * record);
+            bench_opend(&run, record);
+        }
+        sfs_fflush(fd);
+        bench_end(&run, 1);
+    } else {
+        for (int i = 0; i < records; ++i)
+            sfs_pwrite(fd, data, record, (uint64_t) i * record);
+        sfs_sync();
+    }
+
+    if (bench_selected("seqread")) {
+        bench_start(&run, "seqread", param, records);
+        for (int i = 0; i < records; ++i) {
+            bench_opstart(&run);
+            sfs_pread(fd, scratch, record, (uint64_t) i * record);
+            bench_opend(&run, record);
+        }
+        bench_end(&run, 0);
+    }
+
+    int ops = opts.ops < records ? opts.ops : records;
+    if (bench_selected("randread")) {
+        bench_start(&run, "randread", param, ops);
+        for (int i = 0; i < ops; ++i) {
+            uint64_t pos = (uint64_t) (rand() % records) * record;
+            bench_opstart(&run);
+            sfs_pread(fd, scratch, record, pos);
+            bench_opend(&run, record);
+        }
+        bench_end(&run, 0);
+    }
+
+    if (bench_selected("randwrite")) {
+        bench_start(&run, "randwrite", param, ops);
+        for (int i = 0; i < ops; ++i) {
+            uint64_t pos = (uint64_t) (rand() % records) * record;
+            bench_opstart(&run);
+            sfs_pwrite(fd, data, record, pos);
+            bench_opend(&run, record);
+        }
+        sfs_fflush(fd);
+        bench_end(&run, 1);
+    }
+    sfs_fclose(fd);
+    sfs_unmount();
+}
+
+/**
+ * Appends small records to several files in turn, like loggers do
+ */
+static void bench_append(int num_files, int record, uint64_t total) {
+    bench_run_t run;
+    char name[MAXFILENAME];
+    char param[32];
+    int* fds = malloc(num_files * sizeof(int));
+    int ops = total / record;
+
+    if (!bench_selected("append") || bench_format(num_files) != 0) {
+        free(fds);
+        return;
+    }
+    snprintf(param, sizeof(param), "files=%d,rec=%d", num_files, record);
+
+    for (int i = 0; i < num_files; ++i) {
+        bench_filename(name, i);
+        fds[i] = sfs_fopen(name);
+    }
+    bench_start(&run, "append", param, ops);
+    for (int i = 0; i < ops; ++i) {
+        bench_opstart(&run);
+        sfs_fwrite(fds[i % num_files], data, record);
+        bench_opend(&run, record);
+    }
+    for (int i = 0; i < num_files; ++i)
+        sfs_fclose(fds[i]);
+    bench_end(&run, 1);
+    sfs_unmount();
+    free(fds);
+}
+
+/**
+ * Writes, reads back and removes whole files, one operation per file
+ */
+static void bench_files(int num_files, uint64_t file_size) {
+    bench_run_t run;
+    char name[MAXFILENAME];
+    char param[32];
+    char size[24];
+
+    if (!bench_selected("files") || bench_format(num_files) != 0)
+        return;
+    size_param(size, sizeof(size), "size", file_size);
+    snprintf(param, sizeof(param), "n=%d,%s", num_files, size);
+
+    const char* phases[] = {"files-wr", "files-rd", "files-rm"};
+    for (int phase = 0; phase < 3; ++phase) {
+        bench_start(&run, phases[phase], param, num_files);
+        for (int i = 0; i < num_files; ++i) {
+            bench_filename(name, i);
+            bench_opstart(&run);
+            if (phase == 2) {
+                sfs_remove(name);
+                bench_opend(&run, 0);
+                continue;
+            }
+
+            int fd = sfs_fopen(name);
+            for (uint64_t pos = 0; pos < file_size; pos += BENCH_MAX_RECORD) {
+                int len = file_size - pos < BENCH_MAX_RECORD ? file_size - pos : BENCH_MAX_RECORD;
+                if (phase == 0)
+                    sfs_pwrite(fd, data, len, pos);
+                else
+                    sfs_pread(fd, scratch, len, pos);
+            }
+            sfs_fclose(fd);
+            bench_opend(&run, file_size);
+        }
+        bench_end(&run, phase != 1);
+    }
+    sfs_unmount();
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [-b backend] [-c cache blocks] [-t io threads] [-d disk MiB]\n"
+            "          [-f file MiB] [-n files] [-o ops] [-r seed] [-m disk model]\n"
+            "          [workload...]\n"
+            "\n"
+            "Formats %s in the current directory for every workload,\n"
+            "and removes it at the end.\n"
+            "backend: 0 stdio, 1 pio (default), 2 mmap\n"
+            "disk model: e.g. hdd, ssd or hdd,seek_ns=8000000 (default $SFS_DISK_MODEL),\n"
+            "            its time is the device ms column. The requests then run without\n"
+            "            io threads (-t is ignored) so they come in the order of the\n"
+            "            operations, only the journal commits on a timer may still\n"
+            "            move it a little from run to run\n"
+            "workloads: create open list remove seqwrite seqread randread randwrite append files\n",
+            prog, "sfs_disk.disk");
+}
+
+/**
+ * Runs the micro benchmarks (single operations of the API on one file or
+ * on many) and the macro ones (whole files of several counts and sizes),
+ * printing a line per run
+ *
+ * usage: see usage()
+ */
+int main(int argc, char *argv[]) {
+    int c;
+    int threads_set = 0;
+
+    while ((c = getopt(argc, argv, "b:c:t:d:f:n:o:r:m:h")) != -1) {
+        switch (c) {
+        case 'b': opts.backend = atoi(optarg); break;
+        case 'c': opts.cache_blocks = atoi(optarg); break;
+        case 't': opts.io_threads = atoi(optarg); threads_set = 1; break;
+        case 'd': opts.disk_mib = atol(optarg); break;
+        case 'f': opts.file_mib = atol(optarg); break;
+        case 'n': opts.num_files = atoi(optarg); break;
+        case 'o': opts.ops = atoi(optarg); break;
+        case 'r': opts.seed = strtoul(optarg, NULL, 10); break;
+        case 'm': opts.disk_model = optarg; break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    opts.only = argv + optind;
+    opts.num_only = argc - optind;
+    if (opts.file_mib * 2 > opts.disk_mib) {
+        fprintf(stderr, "the disk must hold twice the file size\n");
+        return 1;
+    }
+
+    if (opts.disk_model != NULL) {
+        disk_model_t model;
+        if (parse_disk_model(opts.disk_model, &model) != 0 || set_disk_model(&model) != 0) {
+            fprintf(stderr, "bad disk model %s\n", opts.disk_model);
+            return 1;
+        }
+    }
+    // the device time depends on the order of the requests, which the io
+    // threads and the read ahead they run would leave to the scheduler
+    if ((opts.disk_model != NULL || getenv("SFS_DISK_MODEL") != NULL) && opts.io_threads != 0) {
+        if (threads_set)
+            fprintf(stderr, "a disk model runs the requests without io threads, -t %d ignored\n", opts.io_threads);
+        opts.io_threads = 0;
+    }
+
+    srand(opts.seed);
+    data = malloc(BENCH_MAX_RECORD);
+    scratch = malloc(BENCH_MAX_RECORD);
+    for (int i = 0; i < BENCH_MAX_RECORD; ++i)
+        data[i] = rand();
+
+    printf("# backend %d, cache %d blocks, %d io threads, disk %ld MiB, block %d B, device %s\n",
+           opts.backend, opts.cache_blocks, opts.io_threads, opts.disk_mib, BENCH_BLOCK_SZ,
+           opts.disk_model != NULL ? opts.disk_model : getenv("SFS_DISK_MODEL") != NULL ? getenv("SFS_DISK_MODEL") : "none");
+    bench_header();
+
+    // micro: the metadata operations at a few directory sizes
+    for (int n = opts.num_files / 10 > 0 ? opts.num_files / 10 : 1; n <= opts.num_files; n *= 10)
+        bench_create_open(n);
+
+    // micro: reads and writes of a file at several record sizes
+    int records[] = {1024, 4096, 65536, BENCH_MAX_RECORD};
+    for (int i = 0; i < 4; ++i)
+        bench_records((uint64_t) opts.file_mib << 20, records[i]);
+
+    // micro: small appends to one file and to many
+    bench_append(1, 100, (uint64_t) opts.file_mib << 20 >> 2);
+    bench_append(16, 100, (uint64_t) opts.file_mib << 20 >> 2);
+
+    // macro: whole files, many small ones to a few large ones
+    uint64_t budget = (uint64_t) opts.file_mib << 20;
+    uint64_t sizes[] = {4096, 256 << 10, 4 << 20};
+    for (int i = 0; i < 3; ++i) {
+        int n = budget / sizes[i];
+        if (n > opts.num_files)
+            n = opts.num_files;
+        if (n > 0)
+            bench_files(n, sizes[i]);
+    }
+
+    free(data);
+    free(scratch);
+    unlink("sfs_disk.disk");
+    return 0;
+}
@@ -0,0 +1,155 @@
+#include "sfs_api.h"
+#include "disk_emu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFRAG_MAX_PASSES 4     // compaction passes at most, each one fills holes the previous one left
+
+// what the command line sets, see usage
+typedef struct {
+    int measure_only;
+    int verbose;
+    int compact;
+    char* disk_model;   // see parse_disk_model, SFS_DISK_MODEL if NULL
+} defrag_options_t;
+
+defrag_options_t opts = {0, 0, 1, NULL};
+
+// the layout of the whole disk, see defrag_measure
+typedef struct {
+    uint32_t files;
+    uint32_t fragmented;    // files with more than one extent
+    uint64_t blocks;        // data blocks of all the files
+    uint64_t extents;       // extents of all the files
+    uint32_t free_blocks;
+    uint32_t free_extents;
+    uint32_t largest_free;  // the longest run of free blocks
+} defrag_summary_t;
+
+static double elapsed_ms(struct timespec* start) {
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e3 + (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/**
+ * Measures the layout of every file and of the free space
+ *
+ * @param summary the totals are returned here
+ * @param verbose whether to print a line per file
+ */
+static void defrag_measure(defrag_summary_t* summary, int verbose) {
+    char name[MAXFILENAME + 1];
+    uint32_t pos = 0;
+    sfs_layout_t layout;
+
+    memset(summary, 0, sizeof(defrag_summary_t));
+    while (sfs_getnextentry(&pos, name, NULL)) {
+        if (sfs_layout(name, &layout) != 0)
+            continue;
+        ++summary->files;
+        summary->blocks += layout.blocks;
+        summary->extents += layout.extents;
+        if (layout.extents > 1)
+            ++summary->fragmented;
+        if (verbose)
+            printf("%-24s %8u blocks %6u extents %4u indirect  first %u\n",
+                   name, layout.blocks, layout.extents, layout.ind_blocks, layout.first);
+    }
+    summary->free_blocks = get_free_count();
+    get_free_extents(&summary->free_extents, &summary->largest_free);
+}
+
+static void defrag_print(const char* when, defrag_summary_t* s) {
+    printf("%-7s %u files, %u fragmented, %llu blocks in %llu extents (%.2f per file), "
+           "%u free blocks in %u extents, largest %u\n",
+           when, s->files, s->fragmented, (unsigned long long) s->blocks, (unsigned long long) s->extents,
+           s->files > 0 ? (double) s->extents / s->files : 0.0,
+           s->free_blocks, s->free_extents, s->largest_free);
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [-n] [-v] [-C] [-m disk model]\n"
+            "\n"
+            "Defragments %s in the current directory: the blocks of every\n"
+            "file are moved into one contiguous run, and the files toward the\n"
+            "start of the disk so that the free space is left in one run.\n"
+            "-n  only measure the fragmentation\n"
+            "-v  print the layout of every file\n"
+            "-C  don't compact, only move the fragmented files\n"
+            "-m  e.g. hdd or ssd (default $SFS_DISK_MODEL), to see the device time it took\n",
+            prog, "sfs_disk.disk");
+}
+
+/**
+ * Measures and defragments an existing disk, printing the layout
+ * before and after
+ *
+ * usage: see usage()
+ */
+int main(int argc, char *argv[]) {
+    int c;
+
+    while ((c = getopt(argc, argv, "nvCm:h")) != -1) {
+        switch (c) {
+        case 'n': opts.measure_only = 1; break;
+        case 'v': opts.verbose = 1; break;
+        case 'C': opts.compact = 0; break;
+        case 'm': opts.disk_model = optarg; break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if (opts.disk_model != NULL) {
+        disk_model_t model;
+        if (parse_disk_model(opts.disk_model, &model) != 0 || set_disk_model(&model) != 0) {
+            fprintf(stderr, "bad disk model %s\n", opts.disk_model);
+            return 1;
+        }
+    }
+    if (sfs_reopen() != 0)
+        return 1;
+
+    defrag_summary_t summary;
+    defrag_measure(&summary, opts.verbose);
+    defrag_print("before", &summary);
+    if (opts.measure_only) {
+        sfs_unmount();
+        return 0;
+    }
+
+    // the first pass takes the fragmented files out of the way, the
+    // following ones slide the others into the holes it left
+    struct timespec start;
+    cache_stats_t stats;
+    int moved = 0;
+    reset_cache_stats();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int pass = 0; pass < DEFRAG_MAX_PASSES; ++pass) {
+        int res = sfs_defragall(opts.compact, NULL, NULL);
+        if (res < 0) {
+            fprintf(stderr, "disk error, the files not moved yet are left as they were\n");
+            sfs_unmount();
+            return 1;
+        }
+        moved += res;
+        if (res == 0 || !opts.compact)
+            break;
+    }
+    sfs_sync();
+    get_cache_stats(&stats);
+
+    defrag_measure(&summary, opts.verbose);
+    defrag_print("after", &summary);
+    printf("%d file moves in %.1f ms, device %.1f ms\n", moved, elapsed_ms(&start), stats.device_ns / 1e6);
+    sfs_unmount();
+    return 0;
+}